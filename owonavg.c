@@ -0,0 +1,209 @@
+/*
+ * owonavg.c
+ *				Averages N captures on the host to pull small signals out of the noise.
+ *				Each capture's unwrapped int16 samples are added into int32 accumulators
+ *				(eight at a time with SSE2), either as a plain block average of N captures
+ *				or as an exponential moving average with a weight of 1/2^floor(log2 N), the
+ *				largest power of two no bigger than N, so that it is a shift. Only one frame
+ *				in N comes out, so the output shrinks by the same factor.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "owonavg.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+int owonAverageInit(struct owonAverage *avg, unsigned n, int exponential) {
+	memset(avg, 0, sizeof(*avg));
+	if (n < 2 || n > AVG_MAX_FRAMES) {
+		printf("..Can't average %u captures: 2 to %u please\n", n, AVG_MAX_FRAMES);
+		return -1;
+	}
+	avg->n = n;
+	avg->exponential = exponential;
+	while ((1u << (avg->shift + 1)) <= n)	// exponential weights are powers of two
+		avg->shift++;
+	return 0;
+}
+
+void owonAverageFree(struct owonAverage *avg) {
+	int i;
+
+	for (i = 0; i < MAX_FRAME_CHANNELS; i++) {
+		free(avg->acc[i]);
+		avg->acc[i] = NULL;
+		avg->capacity[i] = 0;
+	}
+	owonFrameFree(&avg->out);
+	owonFrameFree(&avg->counts);
+}
+
+// acc[j] += s[j]
+
+static void accumulate(int32_t *acc, const int16_t *s, unsigned n) {
+	unsigned j = 0;
+
+#ifdef __SSE2__
+	for (; j + 8 <= n; j += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (s + j));
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);	// sign extend to 32 bits
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+		_mm_storeu_si128((__m128i *) (acc + j), _mm_add_epi32(_mm_loadu_si128((__m128i *) (acc + j)), lo));
+		_mm_storeu_si128((__m128i *) (acc + j + 4), _mm_add_epi32(_mm_loadu_si128((__m128i *) (acc + j + 4)), hi));
+	}
+#endif
+	for (; j < n; j++)
+		acc[j] += s[j];
+}
+
+// acc[j] += ((s[j] << AVG_EMA_BITS) - acc[j]) >> shift
+
+static void accumulateEma(int32_t *acc, const int16_t *s, unsigned n, unsigned shift) {
+	unsigned j = 0;
+
+#ifdef __SSE2__
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	for (; j + 8 <= n; j += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (s + j));
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16 - AVG_EMA_BITS);	// sign extend and scale
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16 - AVG_EMA_BITS);
+		__m128i a0 = _mm_loadu_si128((__m128i *) (acc + j));
+		__m128i a1 = _mm_loadu_si128((__m128i *) (acc + j + 4));
+		a0 = _mm_add_epi32(a0, _mm_sra_epi32(_mm_sub_epi32(lo, a0), count));
+		a1 = _mm_add_epi32(a1, _mm_sra_epi32(_mm_sub_epi32(hi, a1), count));
+		_mm_storeu_si128((__m128i *) (acc + j), a0);
+		_mm_storeu_si128((__m128i *) (acc + j + 4), a1);
+	}
+#endif
+	for (; j < n; j++)
+		acc[j] += ((s[j] * (1 << AVG_EMA_BITS)) - acc[j]) >> shift;
+}
+
+static int16_t saturate(int64_t v) {
+	return v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : (int16_t) v;
+}
+
+// a capture taken with different settings can't be averaged with the ones before it
+
+static int sameLayout(const struct owonAverage *avg, const struct owonFrame *frame) {
+	const struct channelHeader *a, *b;
+	int i;
+
+	if (avg->out.channelcount != frame->channelcount)
+		return 0;
+	for (i = 0; i < frame->channelcount; i++) {
+		a = &avg->out.headers[i];
+		b = &frame->headers[i];
+		if (a->samplecount2 != b->samplecount2 || a->timebasecode != b->timebasecode ||
+				a->vertsenscode != b->vertsenscode || a->probexcode != b->probexcode ||
+				strcmp(a->channelname, b->channelname))
+			return 0;
+	}
+	return 1;
+}
+
+static int restart(struct owonAverage *avg, const struct owonFrame *frame) {
+	unsigned n;
+	int i;
+
+	for (i = 0; i < frame->channelcount; i++) {
+		n = frame->headers[i].samplecount2;
+		if (n > avg->capacity[i]) {
+			int32_t *p = realloc(avg->acc[i], n * sizeof(int32_t));
+			if (!p) {
+				printf("..Failed to malloc(%08xh)!\n", (unsigned) (n * sizeof(int32_t)));
+				return -1;
+			}
+			avg->acc[i] = p;
+			avg->capacity[i] = n;
+		}
+		memset(avg->acc[i], 0, n * sizeof(int32_t));
+		avg->out.headers[i] = frame->headers[i];
+	}
+	avg->out.channelcount = frame->channelcount;
+	avg->count = 0;
+	avg->primed = 0;
+	return 0;
+}
+
+// take in one capture. Returns 1 when avg->out holds a new averaged frame, 0
+// while the average is still building up, -1 on failure.
+
+int owonAverageFrame(struct owonAverage *avg, const struct owonFrame *frame) {
+	unsigned j, n;
+	int i;
+
+	if ((!avg->primed || !sameLayout(avg, frame)) && restart(avg, frame) < 0)
+		return -1;
+
+	for (i = 0; i < frame->channelcount; i++) {
+		n = frame->headers[i].samplecount2;
+		if (!avg->exponential)
+			accumulate(avg->acc[i], frame->samples[i], n);
+		else if (!avg->primed)
+			for (j = 0; j < n; j++)			// the first capture seeds the moving average
+				avg->acc[i][j] = frame->samples[i][j] * (1 << AVG_EMA_BITS);
+		else
+			accumulateEma(avg->acc[i], frame->samples[i], n, avg->shift);
+		avg->out.headers[i] = frame->headers[i];
+	}
+	avg->out.model = frame->model;
+	avg->out.timestamp = frame->timestamp;
+	avg->primed++;
+	if (++avg->count < avg->n)
+		return 0;
+
+	for (i = 0; i < frame->channelcount; i++) {
+		int32_t *acc = avg->acc[i];
+		int16_t *out;
+
+		n = frame->headers[i].samplecount2;
+		if (owonFrameReserve(&avg->out, i, n) < 0)
+			return -1;
+		out = avg->out.samples[i];
+		if (avg->exponential)
+			for (j = 0; j < n; j++)
+				out[j] = saturate((acc[j] + (1 << (AVG_EMA_BITS - AVG_OUT_BITS - 1))) >> (AVG_EMA_BITS - AVG_OUT_BITS));
+		else {
+			for (j = 0; j < n; j++) {
+				int64_t v = (int64_t) acc[j] << AVG_OUT_BITS;
+				out[j] = saturate((v >= 0 ? v + avg->n / 2 : v - avg->n / 2) / (int64_t) avg->n);
+			}
+			memset(acc, 0, n * sizeof(int32_t));
+		}
+		avg->out.scale[i] = frame->scale[i] / (1 << AVG_OUT_BITS);
+	}
+	avg->count = 0;
+	avg->emitted++;
+	return 1;
+}
+
+// the averaged frame at the scope's own resolution, for what works in sample
+// counts (the persistence map's rows, the decoders' thresholds). The first own
+// channels are the averager's, with AVG_OUT_BITS to drop; any after them (math
+// channels added to the average) are already in scope counts.
+
+struct owonFrame *owonAverageCounts(struct owonAverage *avg, int own) {
+	const struct owonFrame *out = &avg->out;
+	struct owonFrame *c = &avg->counts;
+	int i, shift;
+	unsigned j, n;
+
+	for (i = 0; i < out->channelcount; i++) {
+		n = out->headers[i].samplecount2;
+		if (owonFrameReserve(c, i, n) < 0)
+			return NULL;
+		shift = i < own ? AVG_OUT_BITS : 0;
+		for (j = 0; j < n; j++)
+			c->samples[i][j] = (int16_t) ((out->samples[i][j] + (1 << shift >> 1)) >> shift);
+		c->headers[i] = out->headers[i];
+		c->scale[i] = out->scale[i] * (1 << shift);
+	}
+	c->channelcount = out->channelcount;
+	c->model = out->model;
+	c->timestamp = out->timestamp;
+	return c;
+}
@@ -0,0 +1,36 @@
+// owonavg.h - host-side averaging of N captures
+
+#ifndef OWONAVG_H
+#define OWONAVG_H
+
+#include <stdint.h>
+#include "owonframe.h"
+
+#define AVG_MAX_FRAMES 65535			  // block sums of int16 samples must fit an int32
+#define AVG_OUT_BITS 4					  // extra fractional bits kept in the averaged samples
+#define AVG_EMA_BITS 12					  // fixed point fraction of the exponential accumulators
+
+// The accumulators are allocated once for the channel layout of the first
+// capture and reused; a capture with different channels, sample counts or
+// settings restarts the average. The averaged frame keeps AVG_OUT_BITS more
+// resolution than the scope, with the mV scale of each channel divided to suit.
+
+struct owonAverage {
+	unsigned n;						// captures per averaged frame
+	int exponential;				// exponential moving average instead of block average
+	unsigned shift;					// exponential: weight of a new capture is 1 / 2^shift
+	int32_t *acc[MAX_FRAME_CHANNELS];
+	unsigned capacity[MAX_FRAME_CHANNELS];
+	unsigned count;					// captures taken in since the last averaged frame
+	unsigned long primed;			// exponential: captures taken in since the last restart
+	unsigned long emitted;
+	struct owonFrame out;			// the averaged frame
+	struct owonFrame counts;		// ..rounded back to the scope's own sample counts
+};
+
+int owonAverageInit(struct owonAverage *avg, unsigned n, int exponential);
+int owonAverageFrame(struct owonAverage *avg, const struct owonFrame *frame);
+struct owonFrame *owonAverageCounts(struct owonAverage *avg, int own);
+void owonAverageFree(struct owonAverage *avg);
+
+#endif // OWONAVG_H
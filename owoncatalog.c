@@ -0,0 +1,456 @@
+/*
+ * owoncatalog.c
+ *				Catalogues large collections of vectorgram dumps by their headers alone, to
+ *				answer questions like "which captures had CH2 at 2V/div and 500us/div?"
+ *				without converting a single sample. Only the 10 byte "SPBx" file header and
+ *				the 51 byte channel headers are read, with pread, stepping from one header to
+ *				the next by blocklength, so the sample blocks never leave the disk. The files
+ *				are shared out between threads.
+ *
+ *				The catalog is a compact binary index, one fixed size record per channel,
+ *				sorted by channel, timebase, sensitivity and frequency. A query maps it and
+ *				binary searches when the channel (and timebase) is given, so even millions of
+ *				channels are filtered in milliseconds.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "owondump.h"
+#include "owonframe.h"
+#include "owonsched.h"
+
+#define CATALOG_MAGIC "OWONCAT1"
+
+// the index file: header, entries, one name offset per file, the names
+
+struct catalogHeader {
+	char magic[8];
+	uint32_t entries, files;
+	uint64_t namesize;
+};
+
+struct catalogEntry {
+	uint64_t offset;					// of the channel header in the file
+	double mtime;						// the file's, i.e. when it was captured
+	uint32_t file;
+	uint32_t samples;
+	uint32_t timebasecode;
+	int32_t vertSensitivity;			// mV/div with the probe, -1 if unknown
+	float t_sample, frequency;
+	char channelname[4];
+	char model;							// 'V', 'W', 'X'
+	uint8_t vertsenscode, probexcode, channel;
+};
+
+struct catalogWorker {
+	pthread_t thread;
+	struct catalogEntry *e;
+	unsigned count, capacity;
+	unsigned long files, skipped;
+};
+
+char **files;
+unsigned filecount;
+atomic_uint nextFile;
+
+static int addEntry(struct catalogWorker *w, const struct catalogEntry *e) {
+	if (w->count == w->capacity) {
+		struct catalogEntry *p = realloc(w->e, (w->capacity * 2 + 64) * sizeof(*p));
+		if (!p) {
+			printf("..Failed to malloc(%08xh)!\n", (unsigned) ((w->capacity * 2 + 64) * sizeof(*p)));
+			return -1;
+		}
+		w->e = p;
+		w->capacity = w->capacity * 2 + 64;
+	}
+	w->e[w->count++] = *e;
+	return 0;
+}
+
+// the headers of one file; its entries are only kept if the whole chain of
+// blocklengths holds up
+
+static int scanFile(struct catalogWorker *w, unsigned f) {
+	unsigned char hdr[VECTORGRAM_BLOCK_HEADER_LENGTH];
+	struct channelHeader h;
+	struct catalogEntry e;
+	unsigned first = w->count;
+	uint64_t pos = VECTORGRAM_FILE_HEADER_LENGTH;
+	struct stat sb;
+	int fd, ch = 0;
+
+	if ((fd = open(files[f], O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+		printf("..Couldn\'t open %s\n", files[f]);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if (pread(fd, hdr, VECTORGRAM_FILE_HEADER_LENGTH, 0) != VECTORGRAM_FILE_HEADER_LENGTH ||
+			hdr[0] != 'S' || hdr[1] != 'P' || hdr[2] != 'B') {
+		close(fd);
+		return -1;						// a bitmap, or not a dump at all
+	}
+	memset(&e, 0, sizeof(e));
+	e.file = f;
+	e.model = hdr[3];
+	e.mtime = sb.st_mtim.tv_sec + sb.st_mtim.tv_nsec / 1e9;
+
+	while (pos < (uint64_t) sb.st_size && ch < MAX_FRAME_CHANNELS) {
+		if (sb.st_size - pos < VECTORGRAM_BLOCK_HEADER_LENGTH ||
+				pread(fd, hdr, VECTORGRAM_BLOCK_HEADER_LENGTH, pos) != VECTORGRAM_BLOCK_HEADER_LENGTH ||
+				owonDecodeChannelHeader(&h, hdr) < 0 ||
+				h.blocklength > sb.st_size - pos - VECTORGRAM_BLOCK_HEADER_CHNAMELEN) {
+			printf("..Skipping %s: damaged at offset %llu\n", files[f], (unsigned long long) pos);
+			w->count = first;
+			close(fd);
+			return -1;
+		}
+		memcpy(e.channelname, h.channelname, sizeof(e.channelname));
+		e.offset = pos;
+		e.samples = h.samplecount2;
+		e.timebasecode = h.timebasecode;
+		e.vertsenscode = h.vertsenscode;
+		e.probexcode = h.probexcode;
+		e.vertSensitivity = h.vertSensitivity;
+		e.t_sample = h.t_sample;
+		e.frequency = h.frequency;
+		e.channel = ch++;
+		if (addEntry(w, &e) < 0) {
+			close(fd);
+			return -1;
+		}
+		pos += VECTORGRAM_BLOCK_HEADER_CHNAMELEN + h.blocklength;	// straight over the samples
+	}
+	close(fd);
+	return 0;
+}
+
+static void *catalogThread(void *arg) {
+	struct catalogWorker *w = arg;
+	unsigned f;
+
+	while ((f = atomic_fetch_add(&nextFile, 1)) < filecount) {
+		if (scanFile(w, f) < 0)
+			w->skipped++;
+		else
+			w->files++;
+	}
+	return NULL;
+}
+
+// the order of the index: channel, timebase, sensitivity, frequency, then the
+// order the files were given in
+
+static int compareKey(const struct catalogEntry *a, const struct catalogEntry *b, int fields) {
+	int c = strncmp(a->channelname, b->channelname, sizeof(a->channelname));
+
+	if (c || fields == 1)
+		return c;
+	if (a->timebasecode != b->timebasecode || fields == 2)
+		return a->timebasecode < b->timebasecode ? -1 : a->timebasecode > b->timebasecode;
+	if (a->vertSensitivity != b->vertSensitivity)
+		return a->vertSensitivity < b->vertSensitivity ? -1 : 1;
+	if (a->frequency != b->frequency)
+		return a->frequency < b->frequency ? -1 : 1;
+	if (a->file != b->file)
+		return a->file < b->file ? -1 : 1;
+	return a->offset < b->offset ? -1 : a->offset > b->offset;
+}
+
+static int byKey(const void *a, const void *b) {
+	return compareKey(a, b, 0);
+}
+
+static int buildCatalog(const char *name, int threads) {
+	struct catalogWorker workers[threads];
+	struct catalogHeader hdr;
+	struct catalogEntry *all;
+	unsigned long total = 0, done = 0, skipped = 0;
+	uint32_t nameoff;
+	char tmpname[strlen(name) + 5];
+	double started = owonNow();
+	unsigned i, k;
+	int running = 0;
+	FILE *fp;
+
+	memset(workers, 0, sizeof(workers));
+	atomic_store(&nextFile, 0);
+	for (i = 0; i < (unsigned) threads; i++)
+		if (pthread_create(&workers[i].thread, NULL, catalogThread, &workers[i]) == 0)
+			running++;
+		else
+			break;
+	if (!running)
+		catalogThread(&workers[running++]);	// couldn't start any threads - do it all here
+	else
+		for (i = 0; i < (unsigned) running; i++)
+			pthread_join(workers[i].thread, NULL);
+
+	for (i = 0; i < (unsigned) running; i++) {
+		total += workers[i].count;
+		done += workers[i].files;
+		skipped += workers[i].skipped;
+	}
+	if (total > UINT32_MAX || (all = malloc(total * sizeof(*all) + 1)) == NULL) {
+		printf("..Failed to malloc(%08lxh)!\n", (unsigned long) (total * sizeof(*all)));
+		return -1;
+	}
+	for (i = 0, total = 0; i < (unsigned) running; i++) {
+		memcpy(all + total, workers[i].e, workers[i].count * sizeof(*all));
+		total += workers[i].count;
+		free(workers[i].e);
+	}
+	qsort(all, total, sizeof(*all), byKey);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CATALOG_MAGIC, sizeof(hdr.magic));
+	hdr.entries = total;
+	hdr.files = filecount;
+	for (k = 0; k < filecount; k++)
+		hdr.namesize += strlen(files[k]) + 1;
+
+	sprintf(tmpname, "%s.tmp", name);
+	if ((fp = fopen(tmpname, "w")) == NULL) {
+		printf("..Failed to open file \'%s\'!\n", tmpname);
+		free(all);
+		return -1;
+	}
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	fwrite(all, sizeof(*all), total, fp);
+	for (k = 0, nameoff = 0; k < filecount; k++) {
+		fwrite(&nameoff, sizeof(nameoff), 1, fp);
+		nameoff += strlen(files[k]) + 1;
+	}
+	for (k = 0; k < filecount; k++)
+		fwrite(files[k], strlen(files[k]) + 1, 1, fp);
+	free(all);
+	if (fclose(fp) || rename(tmpname, name) < 0) {
+		printf("..Failed to write \'%s\'!\n", name);
+		unlink(tmpname);
+		return -1;
+	}
+	printf("..Catalogued %lu channels of %lu files (%lu skipped) into \'%s\' in %.2f s\n",
+		total, done, skipped, name, owonNow() - started);
+	return 0;
+}
+
+struct catalogQuery {
+	char channelname[4];				// "" for any
+	int timebasecode;					// -1 for any
+	int vertSensitivity;				// 0 for any
+	char model;							// 0 for any
+	double fmin, fmax;
+	int namesOnly;
+};
+
+static int matches(const struct catalogEntry *e, const struct catalogQuery *q) {
+	return (!q->channelname[0] || !strncmp(e->channelname, q->channelname, sizeof(e->channelname))) &&
+		(q->timebasecode < 0 || e->timebasecode == (unsigned) q->timebasecode) &&
+		(!q->vertSensitivity || e->vertSensitivity == q->vertSensitivity) &&
+		(!q->model || e->model == q->model) &&
+		e->frequency >= q->fmin && e->frequency <= q->fmax;
+}
+
+// the first entry not before the query's channel (and timebase)
+
+static unsigned lowerBound(const struct catalogEntry *e, unsigned n, const struct catalogEntry *key, int fields) {
+	unsigned lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (compareKey(&e[mid], key, fields) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int queryCatalog(const char *name, const struct catalogQuery *q) {
+	const struct catalogHeader *hdr;
+	const struct catalogEntry *e, *p;
+	const uint32_t *nameoff;
+	const char *names;
+	struct catalogEntry key;
+	unsigned char *seen = NULL;
+	unsigned i, n, hits = 0;
+	int fields = 0, fd;
+	double started = owonNow();
+	struct stat sb;
+	void *map;
+
+	if ((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+		printf("..Couldn\'t open %s\n", name);
+		return -1;
+	}
+	map = sb.st_size >= (off_t) sizeof(*hdr) ? mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	hdr = map;
+	if (map == MAP_FAILED || memcmp(hdr->magic, CATALOG_MAGIC, sizeof(hdr->magic)) ||
+			(uint64_t) sb.st_size != sizeof(*hdr) + (uint64_t) hdr->entries * sizeof(*e) +
+				(uint64_t) hdr->files * sizeof(*nameoff) + hdr->namesize) {
+		printf("..%s is not an owoncatalog index\n", name);
+		if (map != MAP_FAILED)
+			munmap(map, sb.st_size);
+		return -1;
+	}
+	e = (const struct catalogEntry *) (hdr + 1);
+	nameoff = (const uint32_t *) (e + hdr->entries);
+	names = (const char *) (nameoff + hdr->files);
+	n = hdr->entries;
+	if (q->namesOnly && (seen = calloc(hdr->files + 1, 1)) == NULL) {
+		munmap(map, sb.st_size);
+		return -1;
+	}
+
+	i = 0;
+	if (q->channelname[0]) {			// binary search for the first candidate
+		memset(&key, 0, sizeof(key));
+		memcpy(key.channelname, q->channelname, sizeof(key.channelname));
+		key.timebasecode = q->timebasecode;
+		fields = q->timebasecode >= 0 ? 2 : 1;
+		i = lowerBound(e, n, &key, fields);
+	}
+	if (!q->namesOnly)
+		printf("# file\tmodel\tchannel\tsamples\ttimebase(us/div)\tsensitivity(mV/div)\tfrequency(Hz)\theader offset\n");
+	for (; i < n; i++) {
+		p = &e[i];
+		if (fields && compareKey(p, &key, fields))
+			break;						// past the channel (and timebase) asked for
+		if (!matches(p, q) || p->file >= hdr->files)
+			continue;
+		hits++;
+		if (!q->namesOnly)
+			printf("%s\t%c\t%s\t%u\t%g\t%d\t%g\t%llu\n", names + nameoff[p->file], p->model, p->channelname,
+				p->samples, owonTimebaseSeconds(p->timebasecode) * 1e6, p->vertSensitivity, p->frequency,
+				(unsigned long long) p->offset);
+		else if (!seen[p->file]) {
+			seen[p->file] = 1;
+			printf("%s\n", names + nameoff[p->file]);
+		}
+	}
+	// the count goes to stderr so that stdout can be piped straight on
+	fprintf(stderr, "..%u of %u channels in %u files match (%.2f ms)\n", hits, n, hdr->files,
+		(owonNow() - started) * 1e3);
+	free(seen);
+	munmap(map, sb.st_size);
+	return 0;
+}
+
+// the timebase code for us/div, or -1 if the scope has no such timebase
+
+static int timebaseCode(double us) {
+	unsigned code;
+
+	for (code = 0; code <= 0x1f; code++)
+		if (fabs(owonTimebaseSeconds(code) * 1e6 / us - 1) < 0.01)
+			return code;
+	return -1;
+}
+
+static int addName(const char *name) {
+	static unsigned capacity = 0;
+
+	if (filecount == capacity) {
+		char **p = realloc(files, (capacity * 2 + 1024) * sizeof(char *));
+		if (!p)
+			return -1;
+		files = p;
+		capacity = capacity * 2 + 1024;
+	}
+	return (files[filecount++] = strdup(name)) ? 0 : -1;
+}
+
+// file names one per line, for collections too big for the command line
+
+static int readNames(FILE *fp) {
+	char line[4096];
+	size_t len;
+
+	while (fgets(line, sizeof(line), fp)) {
+		len = strcspn(line, "\r\n");
+		line[len] = '\0';
+		if (len && addName(line) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+void usage(void) {
+	printf("..Usage: owoncatalog [-i index] [-j threads] file(s)         build the index\n");
+	printf("        owoncatalog [-i index] [-c channel] [-T us] [-V mV] [-M model] [-F Hz[:Hz]] [-l]\n");
+	printf("                                                             query it\n");
+	printf("        -i s   the index file (default \'catalog.idx\')\n");
+	printf("        -j n   threads reading the headers (default: two per CPU, it\'s mostly waiting on the disk)\n");
+	printf("        file   a dump, or - to read the names from stdin, one per line\n");
+	printf("        -c s   only this channel, e.g. CH2\n");
+	printf("        -T n   only this timebase in us/div, e.g. 500\n");
+	printf("        -V n   only this sensitivity in mV/div (with the probe), e.g. 2000\n");
+	printf("        -M c   only this model: V (PDS5022S), W (PDS6060S), X (PDS7102T)\n");
+	printf("        -F a:b only frequencies from a to b Hz (just a: exactly a)\n");
+	printf("        -l     just the names of the files that match\n");
+}
+
+int main(int argc, char *argv[]) {
+  struct catalogQuery q;
+  char *index = "catalog.idx", *colon;
+  int opt, i, threads = 2 * sysconf(_SC_NPROCESSORS_ONLN), ret;
+
+  memset(&q, 0, sizeof(q));
+  q.timebasecode = -1;
+  q.fmin = -HUGE_VAL;
+  q.fmax = HUGE_VAL;
+  while ((opt = getopt(argc, argv, "i:j:c:T:V:M:F:lh")) != -1) {
+	  switch (opt) {
+		case 'i' : index = optarg;
+				   break;
+		case 'j' : threads = atoi(optarg);
+				   break;
+		case 'c' : if (strlen(optarg) > VECTORGRAM_BLOCK_HEADER_CHNAMELEN) {
+					   usage();
+					   return 0;
+				   }
+				   strcpy(q.channelname, optarg);
+				   break;
+		case 'T' : if ((q.timebasecode = timebaseCode(atof(optarg))) < 0) {
+					   printf("..No timebase of %s us/div\n", optarg);
+					   return 0;
+				   }
+				   break;
+		case 'V' : q.vertSensitivity = atoi(optarg);
+				   break;
+		case 'M' : q.model = optarg[0];
+				   break;
+		case 'F' : q.fmin = q.fmax = atof(optarg);
+				   if ((colon = strchr(optarg, ':')) != NULL)
+					   q.fmax = atof(colon + 1);
+				   break;
+		case 'l' : q.namesOnly = 1;
+				   break;
+		default  : usage();
+				   return 0;
+	  }
+  }
+  if (optind >= argc)
+	  return queryCatalog(index, &q) < 0;
+
+  for (i = optind; i < argc; i++)
+	  if ((strcmp(argv[i], "-") ? addName(argv[i]) : readNames(stdin)) < 0) {
+		  printf("..Failed to malloc the file list!\n");
+		  return 1;
+	  }
+  ret = buildCatalog(index, threads > 0 ? threads : 1);
+  for (i = 0; i < (int) filecount; i++)
+	  free(files[i]);
+  free(files);
+  return ret < 0;
+}
@@ -0,0 +1,284 @@
+/*
+ * owondecode.c
+ *				Serial protocol decoding of the sample blocks of a frame: UART bytes on CH1
+ *				(with auto-baud), SPI words with CH1 as clock and CH2 as data, or I2C
+ *				transactions with CH1 as SCL and CH2 as SDA.
+ *
+ *				Each channel is first digitised with a hysteresis threshold halfway between
+ *				its extremes; the protocols are then decoded from the levels, using t_sample
+ *				from the channel header for timing. The work is one pass per frame, so it
+ *				keeps up with continuous captures and with batches of archived dumps alike.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "owondecode.h"
+#include "owonstats.h"
+
+#define I2C_ITEM_MAX 24						// longest thing appended at once, " addr 0x7f W NAK"
+
+int owonDecodeProtocol(const char *name) {
+	if (!strcmp(name, "uart"))
+		return DECODE_UART;
+	if (!strcmp(name, "spi"))
+		return DECODE_SPI;
+	if (!strcmp(name, "i2c"))
+		return DECODE_I2C;
+	return -1;
+}
+
+void owonDecoderInit(struct owonDecoder *dec, int protocol) {
+	memset(dec, 0, sizeof(*dec));
+	dec->protocol = protocol;
+	dec->spiBits = 8;
+	dec->out = stdout;
+}
+
+void owonDecoderFree(struct owonDecoder *dec) {
+	free(dec->level[0]);
+	free(dec->level[1]);
+	dec->level[0] = dec->level[1] = NULL;
+	dec->capacity = 0;
+}
+
+// threshold a channel into 0/1 levels with 20% hysteresis around the midpoint
+
+static void digitise(uint8_t *level, const int16_t *samples, unsigned n) {
+	struct owonBlockStats st;
+	int lo, hi, swing;
+	uint8_t l;
+	unsigned j;
+
+	owonStatsReset(&st);
+	owonStatsBlock(&st, samples, n);
+	swing = st.max - st.min;
+	if (swing < DECODE_MIN_SWING) {
+		memset(level, st.min > DECODE_MIN_SWING, n);	// flat - high if it sits above ground
+		return;
+	}
+	lo = st.min + swing * 2 / 5;
+	hi = st.min + swing * 3 / 5;
+	l = samples[0] > (lo + hi) / 2;
+	for (j = 0; j < n; j++) {
+		if (samples[j] >= hi)
+			l = 1;
+		else if (samples[j] <= lo)
+			l = 0;
+		level[j] = l;
+	}
+}
+
+// auto-baud: the narrowest complete pulse in the frame is one bit wide. The
+// estimate is kept across frames, dropping to narrower pulses as they turn up
+// and otherwise averaging in pulses that agree with it.
+
+static void updateBitWidth(struct owonDecoder *dec, const uint8_t *level, unsigned n) {
+	unsigned j, last = 0, run, shortest = 0;
+
+	for (j = 1; j < n; j++) {
+		if (level[j] == level[j-1])
+			continue;
+		if (last) {					// the run before the first edge is not complete
+			run = j - last;
+			if (!shortest || run < shortest)
+				shortest = run;
+		}
+		last = j;
+	}
+	if (!shortest)
+		return;
+	if (!dec->bitSamples || shortest < dec->bitSamples * 0.75)
+		dec->bitSamples = shortest;
+	else if (shortest < dec->bitSamples * 1.25)
+		dec->bitSamples = dec->bitSamples * 0.75 + shortest * 0.25;
+}
+
+// a capture that can't be decoded writes nothing. The first one is reported
+// with its reason, the rest are only counted - in continuous mode the same
+// reason would otherwise come up with every capture.
+
+static int undecodable(struct owonDecoder *dec, const char *why) {
+	if (!dec->failed++)
+		printf("..Capture not decoded: %s (any more are only counted)\n", why);
+	return -1;
+}
+
+static int decodeUart(struct owonDecoder *dec, const struct owonFrame *frame, const uint8_t *line, unsigned n) {
+	double t_sample = frame->headers[0].t_sample;
+	double bit;
+	unsigned i, k, pos, byte;
+
+	if (dec->baud > 0)
+		bit = 1e6 / (dec->baud * t_sample);
+	else {
+		updateBitWidth(dec, line, n);
+		bit = dec->bitSamples;
+	}
+	if (!bit)
+		return undecodable(dec, "uart: no complete pulse to measure the bit width by");
+	if (bit < 2)
+		return undecodable(dec, "uart: bit width under 2 samples, too short (use a faster timebase)");
+
+	for (i = 1; i < n; i++) {
+		if (!(line[i-1] && !line[i]))
+			continue;						// waiting for the falling edge of a start bit
+		if ((unsigned) (i + 9.5 * bit) >= n)
+			break;							// byte runs past the end of the frame
+		if (line[(unsigned) (i + 0.5 * bit)])
+			continue;						// glitch, not a start bit
+		byte = 0;
+		for (k = 0; k < 8; k++)
+			byte |= line[(unsigned) (i + (1.5 + k) * bit)] << k;	// LSB first
+		pos = (unsigned) (i + 9.5 * bit);
+		if (line[pos]) {
+			fprintf(dec->out, "%6lu %12.3f us  uart  0x%02x '%c'\n", dec->frames, i * t_sample, byte,
+				byte >= 0x20 && byte < 0x7f ? byte : '.');
+			dec->symbols++;
+		}
+		else {
+			fprintf(dec->out, "%6lu %12.3f us  uart  framing error\n", dec->frames, i * t_sample);
+			dec->errors++;
+		}
+		i = pos;
+	}
+	if (dec->baud <= 0 && !dec->frames)
+		fprintf(dec->out, "# uart: %.0f baud detected\n", 1e6 / (bit * t_sample));
+	return 0;
+}
+
+static void decodeSpi(struct owonDecoder *dec, const struct owonFrame *frame, const uint8_t *clk,
+		const uint8_t *data, unsigned n) {
+	double t_sample = frame->headers[0].t_sample;
+	unsigned i, prev = 0, period = 0, bits = 0, start = 0;
+	uint32_t word = 0;
+
+	for (i = 1; i < n; i++)				// shortest rising-to-rising clock interval
+		if (!clk[i-1] && clk[i]) {
+			if (prev && (!period || i - prev < period))
+				period = i - prev;
+			prev = i;
+		}
+	if (!period)
+		return;
+
+	prev = 0;
+	for (i = 1; i < n; i++) {
+		if (clk[i-1] || !clk[i])
+			continue;
+		if (prev && i - prev > DECODE_SPI_GAP * period && bits) {
+			fprintf(dec->out, "%6lu %12.3f us  spi   %u bit fragment dropped\n", dec->frames, start * t_sample, bits);
+			dec->errors++;
+			bits = 0;
+		}
+		if (!bits) {
+			start = i;
+			word = 0;
+		}
+		word = word << 1 | data[i];		// MSB first
+		if (++bits == dec->spiBits) {
+			fprintf(dec->out, "%6lu %12.3f us  spi   0x%0*x\n", dec->frames, start * t_sample,
+				(int) (dec->spiBits + 3) / 4, word);
+			dec->symbols++;
+			bits = 0;
+		}
+		prev = i;
+	}
+}
+
+// a long transfer (an EEPROM page read, say) doesn't fit on one line: when the
+// line can't take another byte it is written out and carried on in a new one
+
+static int i2cRoom(struct owonDecoder *dec, char *line, size_t size, int len, double t) {
+	if (len < (int) (size - I2C_ITEM_MAX))
+		return len;
+	fprintf(dec->out, "%s ...\n", line);
+	len = snprintf(line, size, "%6lu %12.3f us  i2c   ...", dec->frames, t);
+	return len < (int) size ? len : (int) size - 1;
+}
+
+static void decodeI2c(struct owonDecoder *dec, const struct owonFrame *frame, const uint8_t *scl,
+		const uint8_t *sda, unsigned n) {
+	double t_sample = frame->headers[0].t_sample;
+	char line[512];
+	int len = 0, active = 0;
+	unsigned i, bits = 0, byte = 0, count = 0;
+
+	for (i = 1; i < n; i++) {
+		if (scl[i-1] && scl[i] && sda[i-1] != sda[i]) {
+			if (!sda[i]) {					// SDA falling while SCL high: (repeated) START
+				if (!active)
+					len = snprintf(line, sizeof(line), "%6lu %12.3f us  i2c   START", dec->frames, i * t_sample);
+				else {
+					len = i2cRoom(dec, line, sizeof(line), len, i * t_sample);
+					len += snprintf(line + len, sizeof(line) - len, " RESTART");
+				}
+				active = 1;
+				bits = byte = count = 0;
+			}
+			else if (active) {				// SDA rising while SCL high: STOP
+				fprintf(dec->out, "%s STOP\n", line);
+				dec->symbols++;
+				active = 0;
+			}
+			continue;
+		}
+		if (!active || scl[i-1] || !scl[i])
+			continue;						// data is only valid on the rising edge of SCL
+		if (++bits <= 8) {
+			byte = byte << 1 | sda[i];
+			continue;
+		}
+		len = i2cRoom(dec, line, sizeof(line), len, i * t_sample);
+		if (!count++)
+			len += snprintf(line + len, sizeof(line) - len, " addr 0x%02x %c", byte >> 1, byte & 1 ? 'R' : 'W');
+		else
+			len += snprintf(line + len, sizeof(line) - len, " 0x%02x", byte);
+		len += snprintf(line + len, sizeof(line) - len, sda[i] ? " NAK" : " ACK");
+		bits = byte = 0;
+	}
+	if (active) {
+		fprintf(dec->out, "%s (truncated)\n", line);
+		dec->errors++;
+	}
+}
+
+// decode one frame; returns the number of symbols found in it
+
+int owonDecodeFrame(struct owonDecoder *dec, const struct owonFrame *frame) {
+	unsigned long before = dec->symbols;
+	unsigned n;
+	int k, lines = dec->protocol == DECODE_UART ? 1 : 2;
+
+	if (frame->channelcount < lines)
+		return undecodable(dec, lines == 2 ? "needs CH1 and CH2, the capture only has CH1" : "the capture has no channels");
+	n = frame->headers[0].samplecount2;
+	for (k = 1; k < lines; k++)
+		if (frame->headers[k].samplecount2 < n)
+			n = frame->headers[k].samplecount2;
+
+	if (n > dec->capacity) {
+		for (k = 0; k < 2; k++) {
+			uint8_t *p = realloc(dec->level[k], n);
+			if (!p) {
+				printf("..Failed to malloc(%08xh)!\n", n);
+				return -1;
+			}
+			dec->level[k] = p;
+		}
+		dec->capacity = n;
+	}
+	for (k = 0; k < lines; k++)
+		digitise(dec->level[k], frame->samples[k], n);
+
+	switch (dec->protocol) {
+		case DECODE_UART : if (decodeUart(dec, frame, dec->level[0], n) < 0)
+							   return -1;
+						   break;
+		case DECODE_SPI  : decodeSpi(dec, frame, dec->level[0], dec->level[1], n);
+						   break;
+		case DECODE_I2C  : decodeI2c(dec, frame, dec->level[0], dec->level[1], n);
+						   break;
+	}
+	dec->frames++;
+	return dec->symbols - before;
+}
@@ -0,0 +1,41 @@
+// owondecode.h - UART / SPI / I2C decoding of captured channels
+
+#ifndef OWONDECODE_H
+#define OWONDECODE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "owonframe.h"
+
+#define DECODE_NONE 0
+#define DECODE_UART 1					  // CH1 = line, 8N1, idle high
+#define DECODE_SPI  2					  // CH1 = clock, CH2 = data, sampled on the rising clock edge
+#define DECODE_I2C  3					  // CH1 = SCL, CH2 = SDA
+
+#define DECODE_MIN_SWING 4				  // sample counts - anything flatter is a constant level
+#define DECODE_SPI_GAP 4				  // clock periods of silence that end an SPI word
+
+// one decoder is kept for a whole session: its auto-baud estimate and counters
+// carry over from frame to frame. The frames themselves are separate snapshots,
+// so partly received symbols are dropped at the end of each frame.
+// owonDecodeFrame() returns -1, and writes nothing, for a capture that can't be
+// decoded at all (too few channels, or no usable UART bit width).
+
+struct owonDecoder {
+	int protocol;
+	double baud;				// UART: fixed baud rate, 0 to detect it
+	double bitSamples;			// UART: bit width in samples found so far by auto-baud
+	unsigned spiBits;			// SPI: bits per word
+	unsigned long frames, symbols, errors;
+	unsigned long failed;		// captures that couldn't be decoded at all
+	uint8_t *level[2];			// digitised channels, reused between frames
+	unsigned capacity;
+	FILE *out;					// decoded symbols, one line each
+};
+
+int owonDecodeProtocol(const char *name);
+void owonDecoderInit(struct owonDecoder *dec, int protocol);
+int owonDecodeFrame(struct owonDecoder *dec, const struct owonFrame *frame);
+void owonDecoderFree(struct owonDecoder *dec);
+
+#endif // OWONDECODE_H
@@ -0,0 +1,200 @@
+/*
+ * owondevice.c
+ *				Device manager for owondump. Keeps a table of the attached Owon scopes keyed
+ *				by serial number (or bus) and device node, so that starting another capture, or picking up a
+ *				scope that has just been plugged in, does not mean a fresh open / claim /
+ *				reset of every scope.
+ *
+ *				libusb-0.1 has no hotplug callbacks, but usb_find_busses() and
+ *				usb_find_devices() return the number of changes since their last call, so
+ *				a refresh that finds nothing new costs one directory scan and the table is
+ *				only walked when something has actually arrived or gone away.
+ *
+ *				The reset quirk (see the README) is only applied when a BULK IN read times
+ *				out, instead of unconditionally before every transfer.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "owondevice.h"
+
+struct owonDevice usb_locks[MAX_USB_LOCKS];
+int locksFound = 0;
+
+static int rescanNeeded = 1;			  // forces a table walk after a reset re-enumerates a scope
+
+// the device node changes every time a scope re-enumerates - after a reset or
+// a replug - so it only finds a scope that is still where it was. A scope on a
+// new node is matched by its serial number to the slot it had before; without
+// one (or before its slot is found) an absent slot on the same bus is reused.
+
+static struct owonDevice *findSlot(const char *bus, const char *port) {
+	int i;
+
+	for (i = 0; i < locksFound; i++)
+		if (usb_locks[i].present && !strcmp(usb_locks[i].bus, bus) && !strcmp(usb_locks[i].port, port))
+			return &usb_locks[i];
+	return NULL;
+}
+
+static struct owonDevice *findAbsentSlot(const char *bus, const char *serial) {
+	struct owonDevice *same = NULL;
+	int i;
+
+	for (i = 0; i < locksFound; i++) {
+		if (usb_locks[i].present || strcmp(usb_locks[i].serial, serial))
+			continue;
+		if (!strcmp(usb_locks[i].bus, bus))
+			return &usb_locks[i];
+		if (!same && serial[0])		// a scope with a serial number can come back on another bus
+			same = &usb_locks[i];
+	}
+	return same;
+}
+
+static void readSerial(struct usb_device *dev, char *serial, size_t size) {
+	usb_dev_handle *h;
+
+	serial[0] = '\0';
+	if (!dev->descriptor.iSerialNumber || (h = usb_open(dev)) == NULL)
+		return;
+	if (usb_get_string_simple(h, dev->descriptor.iSerialNumber, serial, size) < 0)
+		serial[0] = '\0';
+	usb_close(h);
+}
+
+// bring the table up to date with the busses - returns the number of scopes that
+// arrived or went away since the last call
+
+int owonDevicesRefresh(void) {
+	struct usb_bus *bus;
+	struct usb_device *dev;
+	struct owonDevice *owon;
+	char serial[sizeof(usb_locks[0].serial)];
+	int seen[MAX_USB_LOCKS];
+	int changes, events = 0;
+	int i;
+
+	changes = usb_find_busses();
+	changes += usb_find_devices();
+	if (!changes && !rescanNeeded)
+		return 0;
+	rescanNeeded = 0;
+
+	memset(seen, 0, sizeof(seen));
+	for (bus = usb_busses; bus; bus = bus->next) {
+	  for (dev = bus->devices; dev; dev = dev->next) {
+		if (dev->descriptor.idVendor != USB_LOCK_VENDOR || dev->descriptor.idProduct != USB_LOCK_PRODUCT)
+			continue;
+		if ((owon = findSlot(bus->dirname, dev->filename)) == NULL) {
+			readSerial(dev, serial, sizeof(serial));
+			if ((owon = findAbsentSlot(bus->dirname, serial)) == NULL) {
+				if (locksFound == MAX_USB_LOCKS) {
+					printf("..Ignoring Owon device on bus %s: already managing %d scopes\n", bus->dirname, MAX_USB_LOCKS);
+					continue;
+				}
+				owon = &usb_locks[locksFound++];
+				memset(owon, 0, sizeof(*owon));
+				strcpy(owon->serial, serial);
+			}
+			strcpy(owon->bus, bus->dirname);
+			strcpy(owon->port, dev->filename);
+		}
+		seen[owon - usb_locks] = 1;
+		owon->dev = dev;	// libusb may hand out a new usb_device after a rescan
+		if (!owon->present) {
+			owon->present = 1;
+			events++;
+			printf("..Found an Owon device %04x:%04x on bus %s%s%s\n", USB_LOCK_VENDOR, USB_LOCK_PRODUCT, bus->dirname,
+				owon->serial[0] ? ", serial " : "", owon->serial);
+		}
+	  }
+	}
+
+	for (i = 0; i < locksFound; i++) {
+		if (usb_locks[i].present && !seen[i]) {
+			printf("..Owon device on bus %s (%s) has gone away\n", usb_locks[i].bus, usb_locks[i].port);
+			owonDeviceClose(&usb_locks[i]);
+			usb_locks[i].dev = NULL;
+			usb_locks[i].present = 0;
+			events++;
+		}
+	}
+	return events;
+}
+
+int owonDevicesPresent(void) {
+	int i, n = 0;
+
+	for (i = 0; i < locksFound; i++)
+		n += usb_locks[i].present;
+	return n;
+}
+
+// open and claim the scope on first use only - later captures reuse the handle
+
+usb_dev_handle *owonDeviceOpen(struct owonDevice *owon) {
+	int ret;
+
+	if (owon->handle)
+		return owon->handle;
+	if (!owon->present)
+		return NULL;
+
+	owon->handle = usb_open(owon->dev);
+	if (!owon->handle) {
+		printf("..Failed to open device on bus %s\n", owon->bus);
+		return NULL;
+	}
+	ret = usb_set_configuration(owon->handle, DEFAULT_CONFIGURATION);
+	ret = usb_claim_interface(owon->handle, DEFAULT_INTERFACE); // interface 0
+	if (ret) {
+		printf("..Failed to claim interface %d: %d : \'%s\'\n", DEFAULT_INTERFACE, ret, strerror(-ret));
+		usb_close(owon->handle);
+		owon->handle = NULL;
+	}
+	return owon->handle;
+}
+
+// the Owon quirk: once the data toggle of the BULK IN endpoint gets stuck, only a
+// device reset shifts it. The reset re-enumerates the scope, so it is looked for
+// again until it turns up on its new node and can be reopened.
+
+int owonDeviceRecover(struct owonDevice *owon) {
+	int i;
+
+	if (!owon->handle)
+		return -1;
+	printf("..Resetting Owon device on bus %s: BULK IN data toggle stuck\n", owon->bus);
+	usb_reset(owon->handle);
+	usb_close(owon->handle);
+	owon->handle = NULL;
+	owon->resets++;
+	owon->present = 0;				// its old node is gone: the first refresh may already see the new one,
+	owon->dev = NULL;				// which has to come back to this slot rather than a new one
+	for (i = 0; i < DEVICE_RESET_TRIES; i++) {
+		usleep(DEVICE_RESET_WAIT);
+		rescanNeeded = 1;
+		owonDevicesRefresh();
+		if (owon->present && owonDeviceOpen(owon))
+			return 0;
+	}
+	printf("..Owon device on bus %s didn\'t come back after the reset\n", owon->bus);
+	return -1;
+}
+
+void owonDeviceClose(struct owonDevice *owon) {
+	if (!owon->handle)
+		return;
+	usb_release_interface(owon->handle, DEFAULT_INTERFACE);
+	usb_close(owon->handle);
+	owon->handle = NULL;
+}
+
+void owonDevicesCloseAll(void) {
+	int i;
+
+	for (i = 0; i < locksFound; i++)
+		owonDeviceClose(&usb_locks[i]);
+}
@@ -0,0 +1,40 @@
+// owondevice.h - persistent table of attached Owon scopes for owondump
+
+#ifndef OWONDEVICE_H
+#define OWONDEVICE_H
+
+#include <limits.h>
+#include <usb.h>
+#include "owondump.h"
+
+#define DEVICE_REFRESH_INTERVAL 1.0		  // seconds between hotplug checks in continuous mode
+#define DEVICE_RESET_WAIT 100000			  // us between looks for a scope re-enumerating after a reset
+#define DEVICE_RESET_TRIES 30
+
+// one slot per scope ever seen. A slot keeps its index for the whole session so
+// that a scope that is reset or unplugged and plugged back in comes back as the
+// same usb_locks[] entry, with the same output filenames and scheduler state:
+// by its serial number, or, for a scope without one, into an absent slot on the
+// same bus.
+
+struct owonDevice {
+	char bus[PATH_MAX+1];		// bus directory name, e.g. "002"
+	char port[PATH_MAX+1];		// device node on that bus, e.g. "005" - new on every re-enumeration
+	char serial[64];			// iSerialNumber string, empty if the scope has none
+	struct usb_device *dev;		// NULL while the scope is unplugged
+	usb_dev_handle *handle;		// opened and claimed once, kept between captures
+	int present;
+	unsigned long resets;		// times the BULK IN reset quirk had to be applied
+};
+
+extern struct owonDevice usb_locks[MAX_USB_LOCKS];
+extern int locksFound;
+
+int owonDevicesRefresh(void);
+int owonDevicesPresent(void);
+usb_dev_handle *owonDeviceOpen(struct owonDevice *owon);
+int owonDeviceRecover(struct owonDevice *owon);
+void owonDeviceClose(struct owonDevice *owon);
+void owonDevicesCloseAll(void);
+
+#endif // OWONDEVICE_H
@@ -16,83 +16,52 @@
 #include <stdint.h>
 #include <string.h>
 #include <endian.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
 #include <usb.h>
 #include "owondump.h"
+#include "owonavg.h"
+#include "owondecode.h"
+#include "owondevice.h"
+#include "owonfilter.h"
+#include "owonframe.h"
+#include "owonmask.h"
+#include "owonmath.h"
+#include "owonpersist.h"
+#include "owonsched.h"
+#include "owonstats.h"
+#include "owonstitch.h"
+#include "owonwriter.h"
 
 int debug = 0;							  // set to 1 for channel data hex dumps
 
-struct usb_device *usb_locks[MAX_USB_LOCKS];
-int locksFound = 0;
-
-char *filename = "output.bin";			  // default output filename
+char *outputname = "output.bin";		  // default output filename
+char *filename;							  // output filename of the capture being written
 int text = 1;							  // tabulated text output as well as raw data output
 int channelcount = 0;					  // the number of channels in the data dump
+long frames = -1;						  // continuous mode: frames per scope (0 = until ^C)
+volatile sig_atomic_t stopRequested = 0;
 
 
 struct channelHeader headers[10];		  // provide for up to ten scope channels
-
-int decodeVertSensCode(int sens_code, int probex_code) {
-	int vertSensitivity=-1;
-	switch (sens_code) {
-	  case 0x01 : vertSensitivity = 5;		// 5mV
-				  break;
-	  case 0x02 : vertSensitivity = 10;
-				  break;
-	  case 0x03 : vertSensitivity = 20;
-				  break;
-	  case 0x04 : vertSensitivity = 50;
-	  			  break;
-	  case 0x05 : vertSensitivity = 100;
-				  break;
-	  case 0x06 : vertSensitivity = 200;
-				  break;
-	  case 0x07 : vertSensitivity = 500;
-				  break;
-	  case 0x08 : vertSensitivity = 1000;
-	  			  break;
-	  case 0x09 : vertSensitivity = 2000;
-				  break;
-	  case 0x0A : vertSensitivity = 5000;	// 5V
-				  break;
-	}
-
-	switch (probex_code) {
-	  case 0x00 : vertSensitivity *= 1;		// x1
-				  break;
-	  case 0x01 : vertSensitivity *= 10;            // x10
-				  break;
-	  case 0x02 : vertSensitivity *= 100;
-				  break;
-	  case 0x03 : vertSensitivity *= 1000;
-        }
-
-	return vertSensitivity;
-}
-
-
-uint32_t get_uint32(const void *p) {
-	uint32_t a;
-	memcpy(&a, p,sizeof(a)); // This is needed because of alignment
-	return le32toh(a);
-}
-
-uint16_t get_uint16(const void *p) {
-	uint16_t a;
-	memcpy(&a, p,sizeof(a)); // This is needed because of alignment
-	return le16toh(a);
-}
-
-int16_t get_int16(const void *p) {
-	uint16_t a;
-	memcpy(&a, p,sizeof(a)); // This is needed because of alignment
-	return (int16_t)le16toh(a);
-}
-
-float get_float(const void *p) {
-	float a;
-	memcpy(&a, p,sizeof(a)); // This is needed because of alignment
-	return a;
-}
+struct owonFrame frame;					  // the capture being written, reused between captures
+struct owonRunningStats running[MAX_USB_LOCKS][MAX_FRAME_CHANNELS];	// per scope, across captures
+struct owonDecoder decoders[MAX_USB_LOCKS];	  // serial protocol decoding, one per scope
+int persistChannel = 0;					  // persistence map of this channel (1 = first), 0 for none
+int persistEye = 0;						  // ..folded on the recovered clock
+struct owonPersist persists[MAX_USB_LOCKS];	  // one map per scope, allocated on its first capture
+unsigned averages = 0;					  // average this many captures into each output frame
+struct owonAverage averagers[MAX_USB_LOCKS];
+int masking = 0;						  // save only the captures that fail the mask
+struct owonMask masks[MAX_USB_LOCKS];	  // same template, bounds worked out per scope
+int stitching = 0;						  // stitch the captures of each scope into one roll record
+struct owonStitch stitches[MAX_USB_LOCKS];
+struct owonMath maths;					  // math channels added to every capture
+int filtering = 0;						  // filter (and decimate) the captures before anything else
+struct owonFilter filters[MAX_USB_LOCKS];  // state carried from one capture of a scope to the next
+unsigned syncGroup = 0;					  // fsync the output files in groups of this many (0 = never)
+struct owonWriter writer;				  // all the per-capture files go through its thread
 
 // decode the contents of the vectorgram data header - providing us with the
 // timebase and voltage values for the channel data hdrBuf has already been
@@ -102,26 +71,7 @@ float get_float(const void *p) {
 struct channelHeader decodeVectorgramBufferHeader(char *hdrBuf) {
 	struct channelHeader header;
 
-// if not a bitmap then must be a vectorgram
-	memcpy(&header.channelname,hdrBuf,3);
-	header.channelname[3]='\0';
-	header.blocklength = get_uint32(hdrBuf+3);
-	header.samplecount1 = get_uint32(hdrBuf+7);
-	header.samplecount2 = get_uint32(hdrBuf+11);
-	header.startoffset = get_uint32(hdrBuf+15);
-	header.timebasecode = get_uint32(hdrBuf+19);
-	header.v_position = (int)get_uint32(hdrBuf+23);
-	header.vertsenscode = get_uint32(hdrBuf+27);
-	header.probexcode = get_uint32(hdrBuf+31);
-	header.t_sample = get_float(hdrBuf+35);
-	header.frequency = get_float(hdrBuf+39);
-	header.period = get_float(hdrBuf+43);
-	header.unknown9 = get_float(hdrBuf+47);
-
-
-	header.vertSensitivity = decodeVertSensCode(header.vertsenscode, header.probexcode);	// 5mV through 5000mV (5V)
-	header.samplePerDiv = header.samplecount1/10;
-	header.timeBase = header.t_sample * header.samplePerDiv * 1000;		    	// in nanoseconds (10E-9)
+	owonDecodeChannelHeader(&header, (const unsigned char *) hdrBuf);	// shared with the library (owonframe.c)
 	printf("Channel: %4s samples: %6u sensitivity: %6u mV timebase: %g us (code %u) t_sample: %g us\n", 
 		header.channelname,
 		header.samplecount1,
@@ -149,131 +99,169 @@ if(debug) {
 	return header;
 }
 
-// add the device locks to an array.
-void found_usb_lock(struct usb_device *dev) {
-  if(locksFound < MAX_USB_LOCKS) {
-    usb_locks[locksFound++] = dev;
-  }
-}
+// the dump itself, handed over to the writer thread as it is (buf is freed there)
 
-struct usb_device *devfindOwon() {
-
-	  struct usb_bus *bus;
-	  struct usb_dev_handle *dh;
-	  int buses = 0;
-	  int devs = 0;
-
-	  buses = usb_find_busses();
-	  devs = usb_find_devices();
-
-	  for (bus = usb_busses; bus; bus = bus->next) {
-		struct usb_device *dev;
-	    for (dev = bus->devices; dev; dev = dev->next)
-	      if(dev->descriptor.idVendor == USB_LOCK_VENDOR && dev->descriptor.idProduct == USB_LOCK_PRODUCT) {
-	        found_usb_lock(dev);
-	        printf("..Found an Owon device %04x:%04x on bus %s\n", USB_LOCK_VENDOR,USB_LOCK_PRODUCT, bus->dirname);
-//	    	printf("..Resetting device.\n");
-	    	dh=usb_open(dev);
-			usb_reset(dh);	// quirky.. device has to be initially reset
-	    	return(dev);	// return the device
-	      }
-	  }
-	  return (NULL);		// No Owon found
+void writeRawData(char *buf, int count, double captured) {
+	owonWriterQueue(&writer, filename, buf, count, captured);
 }
 
-void writeRawData(const unsigned char *buf, int count) {
-	FILE *fp;
-
-	if ((fp=fopen(filename,"w")) == NULL) {
-	  printf("..Failed to open file \'%s\'!\n", filename);
-	  return;
-	}
-//	else 
-//      printf("..Successfully opened file \'%s\'!\n", filename);
-
-	if (fwrite(buf,sizeof(unsigned char), count, fp) != count)
-	  printf("..Failed to write %d bytes to file %s\n", count, filename);
-//	else
-//	  printf("..Successfully written %d bytes to file %s\n", count, filename);
-
-	fclose(fp);
-	return;
-}
 
+// the frame's channels have already been unwrapped (see owonframe.c), so each
+// column is printed straight down its sample array
 
-void writeTextData(const unsigned char *buf, int count) {
+void writeTextData(const struct owonFrame *frame, const struct owonChannelStats *st) {
 	FILE *fpout;
-	const unsigned char *ptr[channelcount];
-	unsigned int  offset[channelcount], n_samples;
+	unsigned int n_samples;
 	int i,j;
-	double time = 0;
-	char txtfilename[strlen(filename)+3];
+	char txtfilename[strlen(filename)+5];
+	char *text;
+	size_t size;
 
 	strcpy(txtfilename,filename);
 	strcat(txtfilename,".txt");
-	if ((fpout = fopen(txtfilename,"w")) == NULL) {
-	  printf("..Failed to open file \'%s\'!\n", txtfilename);
+	if ((fpout = owonWriterOpen(&text, &size)) == NULL)
 	  return;
-	}
 //	printf("..Successfully opened text file \'%s\'!\n", txtfilename);
 
 	fprintf(fpout,"# Timebase: %g us Samples: %u t_sample: %g us\n",
-		headers[0].timeBase / 1000,
-		headers[0].samplecount1,
-		headers[0].t_sample);
-
-	ptr[0] = buf;									// initialise first pointer to start of char *buf
-	ptr[0] += VECTORGRAM_FILE_HEADER_LENGTH;		// +10 bytes to jump over the file header
-	ptr[0] += VECTORGRAM_BLOCK_HEADER_LENGTH;		// +51 bytes to jump over the channel header
-
-	n_samples = headers[0].samplecount2;
-
-//	fprintf(stderr, "ptr[%d] = 0x%p  (offset %d) \n", 0, ptr[0], (int) (ptr[0]-ptr[0]));
+		frame->headers[0].timeBase / 1000,
+		frame->headers[0].samplecount1,
+		frame->headers[0].t_sample);
+	owonStatsPrintHeader(fpout, frame, st);
 
-	for(i=1; i < channelcount; i++) {
-		if (n_samples < headers[i].samplecount2)
-			n_samples = headers[i].samplecount2;
-		ptr[i] = ptr[i-1] + headers[i-1].blocklength + 3;
-//		fprintf(stderr, "ptr[%d] = 0x%p  (offset %d) \n", i, ptr[i], (int) (ptr[i]-ptr[i-1]));
-	}
+	n_samples = 0;
+	for(i=0; i < frame->channelcount; i++)
+		if (n_samples < frame->headers[i].samplecount2)
+			n_samples = frame->headers[i].samplecount2;
 
 // print the channel names as column headers
 
 	fprintf(fpout, "# ");
-	for(i=0; i < channelcount; i++) {
-		offset[i] = headers[i].startoffset;
-		if (offset[i] != 0 && headers[i].samplecount1 == headers[i].samplecount2)
-			offset[i]++; // this adjustment is very strange - but needed...
-		fprintf(fpout, "%s\t", headers[i].channelname);
-	}
+	for(i=0; i < frame->channelcount; i++)
+		fprintf(fpout, "%s\t", frame->headers[i].channelname);
 	fprintf(fpout,"\n");
 
 	for(j=0;j < n_samples;j++) {
-		//fprintf(fpout, "%d", j+1);
-		//fprintf(fpout, "%g\t", time);
-		for(i = 0 ;i < channelcount;i++) {
-			if(j > headers[i].samplecount2)	// no sample available for this timeslot on channel i
+		for(i = 0 ;i < frame->channelcount;i++) {
+			if(j >= frame->headers[i].samplecount2)	// no sample available for this timeslot on channel i
 				fprintf(fpout,"    -\t");
-			else {
-				int n = offset[i] % headers[i].samplecount2;
-				int s = get_int16(&ptr[i][n*2]);
-				fprintf(fpout, "%5.1f\t",  s * headers[i].vertSensitivity * 0.04);
-			}
-			offset[i]++;
-			time += headers[0].t_sample;
+			else
+				fprintf(fpout, "%5.1f\t",  frame->samples[i][j] * frame->scale[i]);
 		}
 	fprintf(fpout, "\n");
 	}
 //	printf("..Successfully written trace data to \'%s\'!\n", txtfilename);
-	if(!fclose(fpout))
-		printf("..Successfully closed text file \'%s\'!\n", txtfilename);
+	if(!owonWriterQueueStream(&writer, txtfilename, fpout, &text, &size, frame->timestamp))
+		printf("..Successfully queued text file \'%s\'!\n", txtfilename);
+}
+
+// machine readable per-channel statistics next to the text output
+
+void writeStatsData(const struct owonFrame *frame, const struct owonChannelStats *st,
+		const struct owonRunningStats *run) {
+	FILE *fp;
+	char statsfilename[strlen(filename)+7];
+	char *text;
+	size_t size;
+
+	strcpy(statsfilename,filename);
+	strcat(statsfilename,".stats");
+	if ((fp = owonWriterOpen(&text, &size)) == NULL)
+	  return;
+	owonStatsWriteSummary(fp, frame, st, run);
+	owonWriterQueueStream(&writer, statsfilename, fp, &text, &size, frame->timestamp);
 }
 
-void readOwonMemory(struct usb_device *dev) {
+// decoded serial protocol, one symbol per line
+
+void writeDecodeData(struct owonDecoder *dec, const struct owonFrame *frame) {
+	char decodefilename[strlen(filename)+8];
+	char *text;
+	size_t size;
+
+	strcpy(decodefilename,filename);
+	strcat(decodefilename,".decode");
+	if ((dec->out = owonWriterOpen(&text, &size)) == NULL) {
+	  dec->out = stdout;
+	  return;
+	}
+	if (owonDecodeFrame(dec, frame) >= 0)
+		owonWriterQueueStream(&writer, decodefilename, dec->out, &text, &size, frame->timestamp);
+	else {
+		fclose(dec->out);			// nothing worth a .decode file
+		free(text);
+	}
+	dec->out = stdout;
+}
+
+// the stitched records grow capture by capture, so their pieces go to the
+// writer thread in order rather than to the disk from the capture loop
+
+static int stitchSink(void *ctx, const char *name, char *data, size_t size, int append) {
+	return owonWriterAppend(ctx, name, data, size, append);
+}
+
+// "output.bin" gives output-<scope>-<channel>.roll
+
+int startStitch(int lock) {
+	const char *slash = strrchr(outputname, '/');
+	const char *dot = strrchr(slash ? slash : outputname, '.');
+	int stem = dot ? dot - outputname : strlen(outputname);
+	char name[strlen(outputname) + 16];
+
+	sprintf(name, "%.*s-%d", stem, outputname, lock);
+	if (owonStitchInit(&stitches[lock], name) < 0)
+		return -1;
+	owonStitchSetSink(&stitches[lock], stitchSink, &writer);
+	return 0;
+}
+
+// everything that happens to a parsed capture (or to an averaged frame) of scope 'lock'.
+// counts is the same frame in the scope's own sample counts, which is what the
+// persistence map and the decoders work in. Returns 0 if the capture passed the
+// mask and nothing was written for it.
+
+int processFrame(int lock, const struct owonFrame *f, const struct owonFrame *counts) {
+	struct owonChannelStats st[MAX_FRAME_CHANNELS];
+	long violations = 0;
+
+	if(masking && (violations = owonMaskFrame(&masks[lock], f)) > 0)
+		printf("..Scope %d: mask failed, %ld samples out of bounds\n", lock, violations);
+	if(persistChannel) {
+		struct owonPersist *p = &persists[lock];
+		if(p->hist || owonPersistInit(p, persistChannel - 1, persistEye) == 0)
+			owonPersistFrame(p, counts);
+	}
+	if(stitching) {
+		struct owonStitch *s = &stitches[lock];
+		if(s->stem || startStitch(lock) == 0)
+			owonStitchFrame(s, f);
+	}
+	if(masking && !violations)
+		return 0;
+	if(text) {
+		owonStatsFrame(st, f);
+		owonRunningUpdate(running[lock], f, st);
+		writeTextData(f, st);
+		writeStatsData(f, st, running[lock]);
+	}
+	if(decoders[lock].protocol)
+		writeDecodeData(&decoders[lock], counts);
+	return 1;
+}
+
+// returns 0 once a trace has been read and written, -1 on any USB failure.
+// The scope stays open and claimed afterwards, ready for the next capture.
+
+int readOwonMemory(struct owonDevice *owon) {
 
 	usb_dev_handle *devHandle = 0;
 
 	signed int ret=0;	// set to < 0 to indicate USB errors
+	int status = -1;
+	int keep = 1;		// 0 once a capture has passed the mask
+	double started;		// host time the trace was asked for
+	int retried = 0;
 	int i=0, j=0;
 
 	unsigned int owonDataBufferSize=0;
@@ -282,38 +270,23 @@ void readOwonMemory(struct usb_device *dev) {
 	char *owonDataBuffer;	 				 // malloc-ed at runtime
 	char *headerptr;						 // used to reference the start of the header
 
-	if(dev->descriptor.idVendor != USB_LOCK_VENDOR || dev->descriptor.idProduct != USB_LOCK_PRODUCT) {
+	if(!owon->present || owon->dev->descriptor.idVendor != USB_LOCK_VENDOR || owon->dev->descriptor.idProduct != USB_LOCK_PRODUCT) {
 	  printf("..Failed device lock attempt: not passed a USB device handle!\n");
-	  return;
+	  return -1;
 	}
 //	printf("..Attempting USB lock on device  %04x:%04x\n",
 //			dev->descriptor.idVendor, dev->descriptor.idProduct);
 
-	devHandle = usb_open(dev);
-
-	if(devHandle > 0) {
-//	  printf("..Trying to claim interface 0 of %04x:%04x \n",
-//			dev->descriptor.idVendor, dev->descriptor.idProduct);
-
-	  ret = usb_set_configuration(devHandle, DEFAULT_CONFIGURATION);
-	  ret = usb_claim_interface(devHandle, DEFAULT_INTERFACE); // interface 0
-
-	  ret = usb_clear_halt(devHandle, BULK_READ_ENDPOINT);
-//	  ret = usb_set_altinterface(devHandle, DEFAULT_INTERFACE);
+	devHandle = owonDeviceOpen(owon);
+	if(!devHandle)
+	  return -1;
 
-	  if(ret) {
-        printf("..Failed to claim interface %d: %d : \'%s\'\n", DEFAULT_INTERFACE, ret, strerror(-ret));
-	    goto bail;
-      }
-	}
-	else {
-	  printf("..Failed to open device..\'%s\'", strerror(-ret));
-	  goto bail;
-	}
+	ret = usb_clear_halt(devHandle, BULK_READ_ENDPOINT);
 
 //	printf("..Successfully claimed interface 0 to %04x:%04x \n",
 //			dev->descriptor.idVendor, dev->descriptor.idProduct);
 
+start:
 //  	printf("..Attempting to get the Device Descriptor\n");
 
   	ret = usb_get_descriptor(devHandle, USB_DT_DEVICE, 0x00, owonDescriptorBuffer, 0x12);
@@ -322,22 +295,13 @@ void readOwonMemory(struct usb_device *dev) {
 	  printf("..Failed to get device descriptor %04x '%s'\n", ret, strerror(-ret));
 	  goto bail;
 	}
-	else
-//	  printf("..Successfully obtained device descriptor!\n");
-/*
-	printf("..Attempting to set device to default configuration\n");
-		ret = usb_set_configuration(devHandle, DEFAULT_CONFIGURATION);
-		if(ret) {
-		  printf("..Failed to set default configuration %d '%s'\n", ret, strerror(-ret));
-		  goto bail;
-		}
-*/
 
 // clear any halt status on the bulk OUT endpoint
 	ret = usb_clear_halt(devHandle, BULK_WRITE_ENDPOINT);
 
 //	printf("..Attempting to bulk write START command to device...\n");
 
+	started = owonWallClock();
 	ret = usb_bulk_write(devHandle, BULK_WRITE_ENDPOINT, OWON_START_DATA_CMD,
 			strlen(OWON_START_DATA_CMD), DEFAULT_TIMEOUT);
 
@@ -355,6 +319,11 @@ void readOwonMemory(struct usb_device *dev) {
 			sizeof(owonCmdBuffer), DEFAULT_TIMEOUT);
 	if(ret < 0) {
 		usb_resetep(devHandle,BULK_READ_ENDPOINT);
+		// a timeout here is the stuck data toggle - reset the scope and try once more
+		if(ret == -ETIMEDOUT && !retried++ && owonDeviceRecover(owon) == 0) {
+			devHandle = owon->handle;
+			goto start;
+		}
 		printf("..Failed to bulk read: %04x (%d) bytes: '%s'\n", (unsigned int) sizeof(owonCmdBuffer),(unsigned int)  sizeof(owonCmdBuffer), strerror(-ret));
 		goto bail;
 	}
@@ -389,7 +358,8 @@ if(debug) {
 			owonDataBufferSize, DEFAULT_BITMAP_READ_TIMEOUT);
 	if(ret < 0) {
 	  printf("..Failed to bulk read: %xh (%d) bytes: %d - '%s'\n", owonDataBufferSize, owonDataBufferSize, ret, strerror(-ret));
-	  usb_reset(devHandle);
+	  free(owonDataBuffer);
+	  owonDeviceRecover(owon);
 	  goto bail;
 	}
 //	else
@@ -408,6 +378,8 @@ if (debug) {
 }
 //determine from the header whether this is bitmap data or vectorgram
 
+    channelcount = 0;		// headers[] is reused for every capture
+
 // is it a 'BM' (bitmap) ?
     if(*owonDataBuffer=='B' &&  *(owonDataBuffer+1)=='M')
         printf("640x480 bitmap of %04xh (%u) bytes\n", *(owonDataBuffer+2), *(owonDataBuffer+2));
@@ -437,6 +409,11 @@ if (debug) {
     	printf("!!! owondatabuffer + owonDataBufferSize (0x%p) > headerptr (0x%p) = %d\n", owonDataBuffer+owonDataBufferSize , headerptr, owonDataBuffer+owonDataBufferSize > headerptr);
 */
     	while( (owonDataBuffer + owonDataBufferSize) > headerptr) {
+    		if(channelcount == MAX_FRAME_CHANNELS ||
+    				owonDataBuffer + owonDataBufferSize - headerptr < VECTORGRAM_BLOCK_HEADER_LENGTH) {
+    			printf("..Damaged vectorgram: no room for another channel header at offset %d\n", (int) (headerptr - owonDataBuffer));
+    			break;
+    		}
  if (debug) {
     		// hexdump the first 0x40 bytes of channel header
     			printf("..Hexdump of channel header :\n");
@@ -448,6 +425,12 @@ if (debug) {
     		    }
  }
     		headers[channelcount] = decodeVectorgramBufferHeader(headerptr);
+    		if(headers[channelcount].blocklength >
+    				(unsigned) (owonDataBuffer + owonDataBufferSize - headerptr) - VECTORGRAM_BLOCK_HEADER_CHNAMELEN) {
+    			printf("..Channel %s: block of %u bytes runs off the end of the dump\n",
+    				headers[channelcount].channelname, headers[channelcount].blocklength);
+    			break;
+    		}
     		headerptr += headers[channelcount].blocklength;
     		headerptr += 3; 									// and jump over the channel name itself
     		channelcount++;
@@ -463,47 +446,333 @@ if (debug) {
 
 // dump the buffer to disk file either as raw data or as tabulated text data as well.
 
-    if(text)
-    	writeTextData((const unsigned char*)owonDataBuffer, owonDataBufferSize);
+    if(channelcount &&
+    		owonFrameLoad(&frame, (const unsigned char*)owonDataBuffer, owonDataBufferSize, headers, channelcount) > 0) {
+    	frame.timestamp = started;
+    	if(filtering && owonFilterFrame(&filters[owon - usb_locks], &frame) == 0) {
+    		unsigned size = owonFrameEncode(&frame, NULL, 0);
+    		char *encoded = malloc(size);
+
+    		if(encoded) {		// the filtered capture stands in for the dump, so the .bin shrinks too
+    			owonFrameEncode(&frame, (unsigned char *) encoded, size);
+    			free(owonDataBuffer);
+    			owonDataBuffer = encoded;
+    			owonDataBufferSize = size;
+    		}
+    	}
+    	if(!averages) {
+    		owonMathFrame(&maths, &frame);
+    		keep = processFrame(owon - usb_locks, &frame, &frame);
+    	}
+    	else if(owonAverageFrame(&averagers[owon - usb_locks], &frame) > 0) {
+    		struct owonFrame *out = &averagers[owon - usb_locks].out, *counts;
+    		int added = owonMathFrame(&maths, out);	// on the average, whose scale stays put
+    		if((counts = owonAverageCounts(&averagers[owon - usb_locks], out->channelcount - added)) != NULL)
+    			processFrame(owon - usb_locks, out, counts);
+    		out->channelcount -= added;				// the averager's own layout again
+    	}
+    }
 
-    writeRawData((const unsigned char*)owonDataBuffer, owonDataBufferSize);
+    if(!averages && keep) {	// when averaging only the averaged frame is written
+    	writeRawData(owonDataBuffer, owonDataBufferSize, started);
+    	owonDataBuffer = NULL;	// the writer thread has it now
+    }
+    status = 0;
 
     free(owonDataBuffer);	// a buffer of vectorgrams is just a few KB in size
 							// but for bitmaps this buffer could be very large (~1MB)
 
-//    printf("..Attempting to release interface %d\n", DEFAULT_INTERFACE);
-    ret = usb_release_interface(devHandle, DEFAULT_INTERFACE);
-    if(ret) {
-      printf("Failed to release interface %d: '%s'\n", DEFAULT_INTERFACE, strerror(-ret));
-	  goto bail;
-    }
-//	printf("..Successful release of interface %d!\n", DEFAULT_INTERFACE);
-
 bail:
-	usb_reset(devHandle);
-	usb_close(devHandle);
-	return;
+	if(ret == -ENODEV)		// unplugged mid-transfer - the next refresh drops it from the table
+	  owonDeviceClose(owon);
+	return status;
 }
 
-int main(int argc, char *argv[]) {
+// in continuous mode every capture gets its own file: "output.bin" becomes
+// "output-<scope>-<frame>.bin", the scope being its index in usb_locks[]
 
-  if (argc>1) {
-	  filename = malloc(strlen(argv[1]));
-	  memcpy(filename, argv[1], strlen(argv[1]));
+void setFrameFilename(int lock, unsigned long frame) {
+	static char *name = NULL;
+	const char *slash = strrchr(outputname, '/');
+	const char *dot = strrchr(slash ? slash : outputname, '.');
+	int stem = dot ? dot - outputname : strlen(outputname);
+
+	free(name);
+	name = malloc(strlen(outputname) + 32);
+	sprintf(name, "%.*s-%d-%06lu%s", stem, outputname, lock, frame, dot ? dot : "");
+	filename = name;
+}
+
+// the persistence maps cover the whole session, so they are queued at the end,
+// once the writer has caught up with the captures:
+// "output.bin" gives output-<scope>.pgm and output-<scope>.csv
+
+static int queuePersistMap(const struct owonPersist *p, const char *name,
+		void (*print)(const struct owonPersist *, FILE *)) {
+	char *data;
+	size_t size;
+	FILE *fp;
+
+	owonWriterDrain(&writer);
+	if ((fp = owonWriterOpen(&data, &size)) == NULL)
+		return -1;
+	print(p, fp);
+	return owonWriterQueueStream(&writer, name, fp, &data, &size, 0);
+}
+
+void writePersistData(void) {
+	const char *slash = strrchr(outputname, '/');
+	const char *dot = strrchr(slash ? slash : outputname, '.');
+	int stem = dot ? dot - outputname : strlen(outputname);
+	char name[strlen(outputname) + 32];
+	int n;
+
+	for (n = 0; n < MAX_USB_LOCKS; n++) {
+		if (!persists[n].hist)
+			continue;
+		if (persists[n].frames) {
+			sprintf(name, "%.*s-%d.pgm", stem, outputname, n);
+			if (!queuePersistMap(&persists[n], name, owonPersistPrintPgm))
+				printf("..Successfully queued persistence map of %lu captures to \'%s\'!\n", persists[n].frames, name);
+			sprintf(name, "%.*s-%d.csv", stem, outputname, n);
+			queuePersistMap(&persists[n], name, owonPersistPrintCsv);
+		}
+		owonPersistFree(&persists[n]);
+	}
+}
+
+// pass / fail totals of the mask test, per scope and per channel
+
+void writeMaskSummary(void) {
+	int n, i;
+
+	for (n = 0; n < MAX_USB_LOCKS; n++) {
+		if (!masks[n].frames)
+			continue;
+		printf("..Scope %d mask: %lu captures, %lu passed, %lu failed\n", n,
+			masks[n].frames, masks[n].passed, masks[n].failed);
+		for (i = 0; i < masks[n].count; i++)
+			if (masks[n].ch[i].violations)
+				printf("..    %s: %lu samples out of bounds\n", masks[n].ch[i].channelname, masks[n].ch[i].violations);
+	}
+}
+
+void writeStitchSummary(void) {
+	struct owonStitchChannel *c;
+	int n, i;
+
+	for (n = 0; n < MAX_USB_LOCKS; n++)
+		for (i = 0; i < stitches[n].count; i++) {
+			c = &stitches[n].ch[i];
+			printf("..Scope %d %s: %lu captures stitched into %lu samples (%lu matched, %lu placed by time, %lu gaps)\n",
+				n, c->channelname, c->frames, c->samples, c->located, c->guessed, c->gaps);
+		}
+}
+
+// what the decoders made of each scope's captures
+
+void writeDecodeSummary(void) {
+	struct owonDecoder *d;
+	int n;
+
+	for (n = 0; n < MAX_USB_LOCKS; n++) {
+		d = &decoders[n];
+		if (d->protocol && (d->frames || d->failed))
+			printf("..Scope %d: decoded %lu symbols (%lu errors) from %lu captures, %lu not decodable\n",
+				n, d->symbols, d->errors, d->frames, d->failed);
+	}
+}
+
+void stopCapture(int sig) {
+	stopRequested = 1;
+}
+
+// poll every scope in usb_locks[] until each has delivered 'frames' traces (or
+// forever for 0), spacing the requests by each scope's acquisition period.
+// Scopes plugged in along the way join the rotation, unplugged ones sit idle
+// until they come back.
+
+void captureContinuous(void) {
+	struct owonSchedEntry sched[MAX_USB_LOCKS];
+	double now, wait, started, lastRefresh;
+	int n, known = 0, pending;
+
+	signal(SIGINT, stopCapture);
+	signal(SIGTERM, stopCapture);
+	lastRefresh = owonNow();
+
+	while (!stopRequested) {
+		now = owonNow();
+		if (now - lastRefresh >= DEVICE_REFRESH_INTERVAL) {
+			owonDevicesRefresh();
+			lastRefresh = now;
+		}
+		for (; known < locksFound; known++)
+			owonSchedAdd(&sched[known], known, now);
+
+		pending = 0;
+		for (n = 0; n < known; n++) {
+			if (frames && sched[n].captures >= (unsigned long) frames) {
+				sched[n].idle = 1;				// this scope is finished
+				continue;
+			}
+			pending++;
+			if (sched[n].idle && usb_locks[n].present)
+				sched[n].due = now;				// plugged back in
+			sched[n].idle = !usb_locks[n].present;
+		}
+		if (known && !pending)
+			break;
+
+		n = owonSchedNext(sched, known, now, &wait);
+		if (n < 0) {
+			if (wait < 0 || wait > DEVICE_REFRESH_INTERVAL)
+				wait = DEVICE_REFRESH_INTERVAL;	// keep watching for hotplug and ^C
+			usleep((useconds_t) (wait * 1e6));
+			continue;
+		}
+
+		setFrameFilename(sched[n].lock, sched[n].captures + 1);
+		started = owonNow();
+		if (readOwonMemory(&usb_locks[sched[n].lock]) < 0)
+			owonSchedFailed(&sched[n], owonNow());
+		else
+			owonSchedCaptured(&sched[n], headers, channelcount, started);
+		if (debug)
+			printf("..Scope %d: acquisition period %g s, next poll in %g s\n", sched[n].lock,
+				sched[n].period, sched[n].due - owonNow());
+	}
+
+	for (n = 0; n < known; n++)
+		printf("..Scope %d (bus %s): %lu captures, %lu failed reads, %lu resets\n", sched[n].lock,
+			usb_locks[n].bus, sched[n].captures, sched[n].failures, usb_locks[n].resets);
+}
+
+void usage(void) {
+	printf("..Usage: owondump [-c frames] [-D uart|spi|i2c] [-b baud] [-w bits] [-a n [-e]] [-P channel [-E]] [-m mask] [-s] [-M def] [-f spec]\n");
+	printf("                [-F n] [-d] [filename]\n");
+	printf("        -c n   continuous mode: capture n traces from every scope (0 = until ^C)\n");
+	printf("        -D p   decode a serial protocol into <filename>.decode\n");
+	printf("               uart: CH1 = line; spi: CH1 = clock, CH2 = data; i2c: CH1 = SCL, CH2 = SDA\n");
+	printf("        -b n   UART baud rate (default: detect it)\n");
+	printf("        -w n   SPI bits per word (default 8)\n");
+	printf("        -a n   write one frame averaged over every n captures (block average; needs -c)\n");
+	printf("        -e     ..as an exponential moving average, weighting each capture by 1/m, where m\n");
+	printf("               is the largest power of two <= n (-a 10 -e weights by 1/8)\n");
+	printf("        -P n   persistence map of channel n (1 = first) over all the captures\n");
+	printf("        -E     fold the persistence map on the recovered clock (eye diagram)\n");
+	printf("        -m f   test every capture against mask template f, save only the failures\n");
+	printf("        -s     stitch the overlapping captures of each scope into <filename>-<scope>-<channel>.roll\n");
+	printf("        -M s   add a math channel defined as NAME=expression, e.g. \'PWR=CH1*CH2\', to every\n");
+	printf("               capture (up to %d; see the README)\n", MATH_MAX_CHANNELS);
+	printf("        -f s   filter and decimate every capture before it is written, e.g. \'iir=50k,dec=4\':\n");
+	printf("               fir=Hz[:taps], iir=Hz[:order] (low-pass), hpf=Hz[:order], dec=N\n");
+	printf("        -F n   fsync the output files in groups of n before they appear (default 0: never)\n");
+	printf("        -d     hex dumps and scheduler debugging\n");
+}
+
+int main(int argc, char *argv[]) {
+  struct owonDecoder decoder;
+  struct owonFilterSpec filterSpec;
+  int opt, i, exponential = 0;
+
+  owonDecoderInit(&decoder, DECODE_NONE);
+  while ((opt = getopt(argc, argv, "c:D:b:w:a:eP:Em:sM:f:F:dh")) != -1) {
+	  switch (opt) {
+		case 'c' : frames = atol(optarg);
+				   break;
+		case 'D' : if ((decoder.protocol = owonDecodeProtocol(optarg)) < 0) {
+					   printf("..Unknown protocol \'%s\'\n", optarg);
+					   return 0;
+				   }
+				   break;
+		case 'b' : decoder.baud = atof(optarg);
+				   break;
+		case 'w' : decoder.spiBits = atoi(optarg);
+				   if (decoder.spiBits < 1 || decoder.spiBits > 32)
+					   decoder.spiBits = 8;
+				   break;
+		case 'a' : averages = atoi(optarg);
+				   break;
+		case 'e' : exponential = 1;
+				   break;
+		case 'P' : persistChannel = atoi(optarg);
+				   break;
+		case 'E' : persistEye = 1;
+				   break;
+		case 'm' : if (owonMaskLoad(&masks[0], optarg) < 0)
+					   return 0;
+				   masking = 1;
+				   break;
+		case 's' : stitching = 1;
+				   break;
+		case 'M' : if (owonMathCompile(&maths, optarg) < 0)
+					   return 0;
+				   break;
+		case 'f' : if (owonFilterParse(&filterSpec, optarg) < 0)
+					   return 0;
+				   filtering = 1;
+				   break;
+		case 'F' : syncGroup = atoi(optarg);
+				   break;
+		case 'd' : debug = 1;
+				   break;
+		default  : usage();
+				   return 0;
+	  }
+  }
+  if (averages && frames < 0) {
+	  printf("..-a averages several captures: use it with -c\n");
+	  return 0;
   }
+  if (optind < argc)
+	  outputname = argv[optind];
+  filename = outputname;
+  for (i = 0; i < MAX_USB_LOCKS; i++)
+	  decoders[i] = decoder;		// same settings, separate auto-baud per scope
+  for (i = 0; averages && i < MAX_USB_LOCKS; i++)
+	  if (owonAverageInit(&averagers[i], averages, exponential) < 0)
+		  return 0;
+  for (i = 1; masking && i < MAX_USB_LOCKS; i++)
+	  masks[i] = masks[0];			// no bounds allocated yet, so a plain copy will do
+  for (i = 0; filtering && i < MAX_USB_LOCKS; i++)
+	  owonFilterInit(&filters[i], &filterSpec);
+
+  if (owonWriterStart(&writer, syncGroup) < 0)
+	  return 0;
 
 //  printf("..Initialising libUSB\n");
   usb_init();
 
 //  printf("..Searching USB buses for Owon\n");
 
-  if(!devfindOwon()) {
-	  printf("..No Owon device %04x:%04x found\n", USB_LOCK_VENDOR, USB_LOCK_PRODUCT);
-	  return 0;
+  owonDevicesRefresh();
+  if (frames >= 0) {
+	  if (!locksFound)
+		  printf("..Waiting for an Owon device %04x:%04x\n", USB_LOCK_VENDOR, USB_LOCK_PRODUCT);
+	  captureContinuous();
   }
+  else if (!locksFound)
+	  printf("..No Owon device %04x:%04x found\n", USB_LOCK_VENDOR, USB_LOCK_PRODUCT);
   else
-	readOwonMemory(usb_locks[0]);
-//	for(i = 0; i < locksFound; i++)
-//	  readOwonMemory(usb_locks[i]);
+	readOwonMemory(&usb_locks[0]);
+  owonDevicesCloseAll();
+  writePersistData();
+  owonWriterStop(&writer);
+  if (writer.written || writer.dropped || writer.failed)
+	  printf("..Written %lu files (%.1f MB, %lu fsync groups), %lu dropped with the queue full, %lu failed\n",
+		  writer.written, writer.bytes / 1e6, writer.syncs, writer.dropped, writer.failed);
+  writeMaskSummary();
+  writeStitchSummary();
+  writeDecodeSummary();
+  owonFrameFree(&frame);
+  owonMathFree(&maths);
+  for (i = 0; i < MAX_USB_LOCKS; i++) {
+	  owonDecoderFree(&decoders[i]);
+	  owonAverageFree(&averagers[i]);
+	  owonMaskFree(&masks[i]);
+	  owonStitchFree(&stitches[i]);
+	  owonFilterFree(&filters[i]);
+  }
   return 0;
 }
@@ -1,6 +1,9 @@
 // owondump.h - linux USB userspace driver for the owon PDS digital storage scopes
 // Copyright 2009 Michael Murphy <ee07m060@elec.qmul.ac.uk>
 
+#ifndef OWONDUMP_H
+#define OWONDUMP_H
+
 #define USB_LOCK_VENDOR 0x5345			  // Dev : (5345) Owon Technologies
 #define USB_LOCK_PRODUCT 0x1234			  // 	   (1234) PDS Digital Oscilloscope
 #define OWON_START_DATA_CMD "START"
@@ -39,3 +42,4 @@ struct channelHeader {
 	double timeBase;        // in nanoseconds (10E-9)
 };
 
+#endif // OWONDUMP_H
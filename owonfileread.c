@@ -15,8 +15,19 @@
 #include <arpa/inet.h> // for htonl() macro
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "owondump.h"
+#include "owondecode.h"
+#include "owonframe.h"
+#include "owonmask.h"
+#include "owonfilter.h"
+#include "owonmath.h"
+#include "owonpersist.h"
+#include "owonstats.h"
+#include "owonstitch.h"
+#include "owonstream.h"
 
 int debug = 0;							  // set to 1 for channel data hex dumps
 
@@ -25,112 +36,15 @@ int text = 1;							  // tabulated text output as well as raw data output
 int channelcount = 0;					  // the number of channels in the data dump
 
 struct channelHeader headers[10];		  // provide for up to ten scope channels
-
-int decodeVertSensCode(long int i) {
-// This is the one byte vertical sensitivity code
-	char c = (char) i;
-	int vertSensitivity=-1;
-	switch (c) {
-	  case 0x01	: vertSensitivity = 5;		// 5mV
-				  break;
-	  case 0x02 : vertSensitivity = 10;
-				  break;
-	  case 0x03 : vertSensitivity = 20;
-				  break;
-	  case 0x04 : vertSensitivity = 50;
-	  			  break;
-	  case 0x05	: vertSensitivity = 100;
-				  break;
-	  case 0x06 : vertSensitivity = 200;
-				  break;
-	  case 0x07 : vertSensitivity = 500;
-				  break;
-	  case 0x08 : vertSensitivity = 1000;
-	  			  break;
-	  case 0x09 : vertSensitivity = 2000;
-				  break;
-	  case 0x0A : vertSensitivity = 5000;	// 5V
-				  break;
-	}
-	return vertSensitivity;
-}
-
-
-long long int decodeTimebase(long int i) {
-	long long int timebase=-1;
-// c is the one byte timebase code
-	char c = (char) i;
-// return an LL int
-	switch (c) {
-		  case 0x00	: timebase = 5LL;	// in nanoseconds
-					  break;
-		  case 0x01	: timebase = 10LL;
-					  break;
-		  case 0x02 : timebase = 25LL;
-					  break;
-		  case 0x03	: timebase = 50LL;
-					  break;
-		  case 0x04	: timebase = 100LL;
-					  break;
-		  case 0x05	: timebase = 250LL;
-					  break;
-		  case 0x06	: timebase = 500LL;
-					  break;
-		  case 0x07	: timebase = 1000LL; // 1 microsecond
-					  break;
-		  case 0x08	: timebase = 2500LL;
-					  break;
-		  case 0x09	: timebase = 5000LL;
-					  break;
-		  case 0x0a : timebase = 10000LL;
-					  break;
-		  case 0x0b	: timebase = 25000LL;
-					  break;
-		  case 0x0c	: timebase = 50000LL;
-					  break;
-		  case 0x0d	: timebase = 100000LL;
-					  break;
-		  case 0x0e	: timebase = 250000LL;
-					  break;
-		  case 0x0f	: timebase = 500000LL;
-					  break;
-		  case 0x10	: timebase = 1000000LL;	// 1 millisecond
-					  break;
-		  case 0x11 : timebase = 2500000LL;
-					  break;
-		  case 0x12	: timebase = 5000000LL;
-					  break;
-		  case 0x13	: timebase = 10000000LL;	// 10 ms
-					  break;
-		  case 0x14	: timebase = 25000000LL;
-					  break;
-		  case 0x15	: timebase = 50000000LL;
-					  break;
-		  case 0x16	: timebase = 100000000LL;	// 100 ms
-					  break;
-		  case 0x17	: timebase = 250000000LL;
-					  break;
-		  case 0x18	: timebase = 500000000LL;
-					  break;
-		  case 0x19	: timebase = 1000000000LL;	// 1 second
-					  break;
-		  case 0x1a	: timebase = 2500000000LL;
-					  break;
-		  case 0x1b	: timebase = 5000000000LL;
-					  break;
-		  case 0x1c	: timebase = 10000000000LL;
-					  break;
-		  case 0x1d	: timebase = 25000000000LL;
-					  break;
-		  case 0x1e	: timebase = 50000000000LL;
-					  break;
-		  case 0x1f	: timebase = 100000000000LL;	// 100 seconds
-					  break;
-		  default	: printf("..Unknown timebase code of %02x\n", c);
-	}
-//	printf("decodetimebase passed %02x and returned %Ld\n", c, timebase);
-	return timebase;
-}
+struct owonFrame frame;					  // the dump with its channels unwrapped
+struct owonDecoder decoder;				  // serial protocol decoding, shared by all the files
+int masking = 0;						  // convert only the files that fail the mask
+struct owonMask mask;
+int stitching = 0;						  // stitch the files into one roll record instead of converting them
+struct owonStitch stitch;
+struct owonMath maths;					  // math channels added to every file
+int filtering = 0;						  // filter (and decimate) the files before anything else
+struct owonFilter filter;				  // carried from one file to the next, as one stream
 
 // decode the contents of the vectorgram data header - providing us with the timebase and voltage values for the channel data
 // hdrBuf has already been stripped of the 10 byte vectorgram file header that begins "SPB......"
@@ -139,24 +53,7 @@ long long int decodeTimebase(long int i) {
 struct channelHeader decodeVectorgramBufferHeader(char *hdrBuf) {
 	struct channelHeader header;
 
-// if not a bitmap then must be a vectorgram
-	memcpy(&header.channelname,hdrBuf,3);
-	header.channelname[3]='\0';
-	memcpy(&header.blocklength, hdrBuf+3,4);
-	memcpy(&header.samplecount1, hdrBuf+7,4);
-	memcpy(&header.samplecount2, hdrBuf+11,4);
-	memcpy(&header.startoffset, hdrBuf+15,4);
-	memcpy(&header.timebasecode, hdrBuf+19,4);
-	memcpy(&header.v_position, hdrBuf+23,4);
-	memcpy(&header.vertsenscode, hdrBuf+27,4);
-	memcpy(&header.probexcode, hdrBuf+31,4);
-	memcpy(&header.t_sample, hdrBuf+35,4);
-	memcpy(&header.frequency, hdrBuf+39,4);
-	memcpy(&header.period, hdrBuf+43,4);
-	memcpy(&header.unknown9, hdrBuf+43,4);
-
-	header.vertSensitivity = decodeVertSensCode(header.vertsenscode);	// 5mV through 5000mV (5V)
-	header.timeBase = decodeTimebase(header.timebasecode);		    	// in nanoseconds (10E-9)
+	owonDecodeChannelHeader(&header, (const unsigned char *) hdrBuf);	// shared with the library (owonframe.c)
 
 	printf("-------------------------------\n");
 	printf("              Channel: %s\n", header.channelname);
@@ -184,12 +81,10 @@ if(debug) {
 	return header;
 }
 
-void writeTextData(char *buf, int count) {
+void writeTextData(const struct owonFrame *frame, const struct owonChannelStats *st) {
 	FILE *fpout;
-	char *ptr[channelcount];
-
 	int i,j;
-	char txtfilename[strlen(filename)+3];
+	char txtfilename[strlen(filename)+5];
 	strcpy(txtfilename,filename);
 	strcat(txtfilename,".txt");
 	if ((fpout = fopen(txtfilename,"w")) == NULL) {
@@ -198,24 +93,14 @@ void writeTextData(char *buf, int count) {
 	}
 	printf("..Successfully opened text file \'%s\'!\n", txtfilename);
 
-	fprintf(fpout,"# Units:(mV) -- Timebase: (%gms)\n", (double) headers[0].timeBase / 1000000);
-
-	ptr[0] = buf;									// initialise first pointer to start of char *buf
-	ptr[0] += VECTORGRAM_FILE_HEADER_LENGTH;		// +10 bytes to jump over the file header
-	ptr[0] += VECTORGRAM_BLOCK_HEADER_LENGTH;		// +51 bytes to jump over the channel header
-
-//	fprintf(stderr, "ptr[%d] = 0x%p  (offset %d) \n", 0, ptr[0], (int) (ptr[0]-ptr[0]));
+	fprintf(fpout,"# Units:(mV) -- Timebase: (%gms)\n", (double) frame->headers[0].timeBase / 1000000);
+	owonStatsPrintHeader(fpout, frame, st);
 
 // print the channel names as column headers
 
-	for(i=1; i < channelcount; i++) {
-		ptr[i] = ptr[i-1] + (int) headers[i-1].blocklength + 3;
-//		fprintf(stderr, "ptr[%d] = 0x%p  (offset %d) \n", i, ptr[i], (int) (ptr[i]-ptr[i-1]));
-	}
-
 	fprintf(fpout, "#");
-	for(i=0; i < channelcount; i++)
-		fprintf(fpout, "\t\t  %s", headers[i].channelname);
+	for(i=0; i < frame->channelcount; i++)
+		fprintf(fpout, "\t\t  %s", frame->headers[i].channelname);
 	fprintf(fpout,"\n");
 
 // for the sake of pointer sanity, we must check the sample count of every channel..
@@ -226,14 +111,13 @@ void writeTextData(char *buf, int count) {
 //
 // see the README in the tarball for perhaps how the text data file should be written.
 
-	for(j=0;j < (int) headers[0].samplecount1;j++) {
+	for(j=0;j < (int) frame->headers[0].samplecount2;j++) {
 		fprintf(fpout, "%d", j+1);
-		for(i = 0 ;i < channelcount;i++) {
-			if(j > (int) headers[i].samplecount1)	// no sample available for this timeslot on channel i
+		for(i = 0 ;i < frame->channelcount;i++) {
+			if(j >= (int) frame->headers[i].samplecount2)	// no sample available for this timeslot on channel i
 				fprintf(fpout,"\t\t    -");
 			else
-				fprintf(fpout, "\t\t%5.1f", (short int) *ptr[i] * headers[i].vertSensitivity * 0.04);
-			ptr[i]+=2;
+				fprintf(fpout, "\t\t%5.1f", frame->samples[i][j] * frame->scale[i]);
 		}
 	fprintf(fpout, "\n");
 	}
@@ -242,6 +126,43 @@ void writeTextData(char *buf, int count) {
 		printf("..Successfully closed text file \'%s\'!\n", txtfilename);
 }
 
+// machine readable per-channel statistics next to the text output
+
+void writeStatsData(const struct owonFrame *frame, const struct owonChannelStats *st) {
+	FILE *fp;
+	char statsfilename[strlen(filename)+7];
+
+	strcpy(statsfilename,filename);
+	strcat(statsfilename,".stats");
+	if ((fp = fopen(statsfilename,"w")) == NULL) {
+	  printf("..Failed to open file \'%s\'!\n", statsfilename);
+	  return;
+	}
+	owonStatsWriteSummary(fp, frame, st, NULL);
+	fclose(fp);
+}
+
+// decoded serial protocol, one symbol per line
+
+void writeDecodeData(const struct owonFrame *frame) {
+	char decodefilename[strlen(filename)+8];
+	int ret;
+
+	strcpy(decodefilename,filename);
+	strcat(decodefilename,".decode");
+	if ((decoder.out = fopen(decodefilename,"w")) == NULL) {
+	  printf("..Failed to open file \'%s\'!\n", decodefilename);
+	  return;
+	}
+	ret = owonDecodeFrame(&decoder, frame);
+	fclose(decoder.out);
+	decoder.out = stdout;
+	if (ret >= 0)
+		printf("..Successfully decoded trace data to \'%s\'!\n", decodefilename);
+	else
+		unlink(decodefilename);		// nothing worth a .decode file
+}
+
 void readOwonBinFile(FILE *fp) {
 
 	int i, j, ret;
@@ -253,6 +174,7 @@ void readOwonBinFile(FILE *fp) {
 
 	fd = fileno(fp);
 	fstat(fd, &buf);
+	channelcount = 0;						 // headers[] is reused for every file
 
 	owonFileSize = buf.st_size;
 
@@ -314,6 +236,11 @@ if (debug) {
 //    	printf("owonFileSize = %Ld\n", (long long int)owonFileSize);
 
     	while((owonDataBuffer+owonFileSize) > headerptr) {
+    		if(channelcount == MAX_FRAME_CHANNELS ||
+    				owonDataBuffer + owonFileSize - headerptr < VECTORGRAM_BLOCK_HEADER_LENGTH) {
+    			printf("..Damaged vectorgram: no room for another channel header at offset %d\n", (int) (headerptr - owonDataBuffer));
+    			break;
+    		}
 if (debug) {
     		// hexdump the first 0x50 bytes of channel header
     			printf("..Hexdump of channel header :\n");
@@ -325,6 +252,12 @@ if (debug) {
     		    }
 }	// end if (debug)
     		headers[channelcount] = decodeVectorgramBufferHeader(headerptr);
+    		if(headers[channelcount].blocklength >
+    				(unsigned) (owonDataBuffer + owonFileSize - headerptr) - VECTORGRAM_BLOCK_HEADER_CHNAMELEN) {
+    			printf("..Channel %s: block of %u bytes runs off the end of the file\n",
+    				headers[channelcount].channelname, headers[channelcount].blocklength);
+    			break;
+    		}
     		headerptr += (int) headers[channelcount].blocklength;
     		headerptr += 3; // and jump over the channel name itself
     		channelcount++;
@@ -340,8 +273,35 @@ if (debug) {
 
 // dump the buffer to disk as tabulated text data.
 
-    writeTextData(owonDataBuffer, owonFileSize);
+    if(channelcount &&
+    		owonFrameLoad(&frame, (const unsigned char *) owonDataBuffer, owonFileSize, headers, channelcount) > 0) {
+    	struct owonChannelStats st[MAX_FRAME_CHANNELS];
+    	long violations;
+
+    	frame.timestamp = buf.st_mtim.tv_sec + buf.st_mtim.tv_nsec / 1e9;	// written as it was captured
+    	if(filtering)
+    		owonFilterFrame(&filter, &frame);
+    	owonMathFrame(&maths, &frame);
+    	if(stitching) {
+    		owonStitchFrame(&stitch, &frame);
+    		goto done;
+    	}
+    	if(masking) {
+    		if((violations = owonMaskFrame(&mask, &frame)) == 0) {
+    			printf("..%s: PASS\n", filename);
+    			goto done;
+    		}
+    		if(violations > 0)
+    			printf("..%s: FAIL, %ld samples out of bounds\n", filename, violations);
+    	}
+    	owonStatsFrame(st, &frame);
+    	writeTextData(&frame, st);
+    	writeStatsData(&frame, st);
+    	if(decoder.protocol)
+    		writeDecodeData(&frame);
+    }
 
+done:
     free(owonDataBuffer);	// a buffer of vectorgrams is just a few KB in size
 							// but for bitmaps this buffer could be very large (~1MB)
 
@@ -349,27 +309,397 @@ bail:
 	return;
 }
 
+// streaming conversion: one dump after another straight off a file, pipe or
+// stdin, each channel written to <stem>-<dump>-<channel>.txt as its samples go
+// by. The samples stored before the start offset belong at the end of the
+// trace, so they are parked in a temporary file until the channel is done, and
+// the files of a dump are only kept once the whole dump has come through.
+
+unsigned long streamed = 0;				  // -S: dumps numbered across all the files, so -o names don't repeat
+
+void streamDumps(const char *name, const char *stem) {
+	struct owonStream s;
+	struct owonStreamItem item;
+	struct owonBlockStats bs;
+	struct owonChannelStats st[MAX_FRAME_CHANNELS];
+	FILE *out = NULL, *spill = NULL;
+	char outnames[MAX_FRAME_CHANNELS][strlen(stem) + 32];
+	unsigned wrap = 0, n, j, k;
+	double scale = 0;
+	char line[4096];
+	int fd, c = 0;
+
+	if (!strcmp(name, "-"))
+		fd = 0;
+	else if ((fd = open(name, O_RDONLY)) < 0) {
+		printf("..Couldn\'t open %s\n", name);
+		return;
+	}
+	if (owonStreamOpen(&s, fd, STREAM_WINDOW) < 0) {
+		if (fd)
+			close(fd);
+		return;
+	}
+
+	while (owonStreamNext(&s, &item)) {
+		switch (item.type) {
+		  case STREAM_DUMP :
+			streamed++;
+			c = 0;
+			break;
+
+		  case STREAM_CHANNEL :
+			sprintf(outnames[c], "%s-%lu-%s.txt", stem, streamed, item.header->channelname);
+			if ((out = fopen(outnames[c], "w")) == NULL) {
+				printf("..Failed to open file \'%s\'!\n", outnames[c]);
+				break;
+			}
+			fprintf(out, "# Units:(mV) -- Timebase: (%gms) -- %s of dump %lu at offset %llu\n",
+				item.header->timeBase / 1000000, item.header->channelname, streamed, (unsigned long long) item.offset);
+			n = item.header->samplecount2;
+			wrap = item.header->startoffset;
+			if (wrap != 0 && item.header->samplecount1 == item.header->samplecount2)
+				wrap++;		// the same adjustment as owonFrameLoad()
+			wrap = n ? wrap % n : 0;
+			if (wrap && (spill = tmpfile()) == NULL) {
+				printf("..Failed to open a temporary file, \'%s\' is left in stored order\n", outnames[c]);
+				wrap = 0;
+			}
+			scale = item.header->vertSensitivity * SAMPLE_MV_PER_COUNT;
+			owonStatsReset(&bs);
+			break;
+
+		  case STREAM_SAMPLES :
+			if (!out)
+				break;
+			owonStatsBlock(&bs, item.samples, item.count);
+			for (j = 0; j < item.count; j++)
+				fprintf(item.first + j < wrap ? spill : out, "%5.1f\n", item.samples[j] * scale);
+			break;
+
+		  case STREAM_CHANNEL_END :
+			if (!out)
+				break;
+			if (spill) {
+				rewind(spill);
+				while ((k = fread(line, 1, sizeof(line), spill)) > 0)
+					fwrite(line, 1, k, out);
+				fclose(spill);
+				spill = NULL;
+			}
+			fclose(out);
+			out = NULL;
+			owonStatsScale(&st[c++], &bs, scale);
+			break;
+
+		  case STREAM_DUMP_END :
+			for (j = 0; j < (unsigned) c; j++)
+				printf("..%s: %llu samples, Vpp %.1fmV, mean %.1fmV, rms %.1fmV\n", outnames[j],
+					(unsigned long long) st[j].n, st[j].vpp, st[j].mean, st[j].rms);
+			c = 0;
+			break;
+
+		  case STREAM_DAMAGED :		// don't leave any of it behind
+			if (out) {
+				fclose(out);
+				out = NULL;
+				c++;
+			}
+			if (spill) {
+				fclose(spill);
+				spill = NULL;
+			}
+			for (j = 0; j < (unsigned) c; j++) {
+				unlink(outnames[j]);
+				printf("..Dropped \'%s\'\n", outnames[j]);
+			}
+			c = 0;
+			break;
+		}
+	}
+	printf("..Streamed %lu dumps from %s (%lu damaged, %llu bytes skipped)\n", s.dumps,
+		fd ? name : "stdin", s.damaged, (unsigned long long) s.skipped);
+	owonStreamClose(&s);
+	if (fd)
+		close(fd);
+}
+
+// persistence batch: the files are handed out to worker threads, each with its
+// own frame and histogram, and the histograms are added together at the end
+
+struct persistWorker {
+	pthread_t thread;
+	int threaded;							// 0: ran in the calling thread
+	struct owonPersist persist;
+	struct owonMath math;					// the math channels need buffers of their own
+	struct owonFilter filter;				// ..and so does the filter
+	unsigned long files, failed;
+};
+
+char **persistFiles;
+int persistFileCount, persistNext = 0;
+pthread_mutex_t persistLock = PTHREAD_MUTEX_INITIALIZER;
+
+// read and parse one of the files, filtered from steady state
+
+static int persistLoad(const char *name, unsigned char **buf, size_t *bufsize, struct owonFrame *frame,
+		struct owonFilter *f) {
+	struct stat sb;
+	FILE *fp;
+	int ret = -1;
+
+	if ((fp = fopen(name, "r")) == NULL || fstat(fileno(fp), &sb) < 0) {
+		printf("..Couldn\'t open %s\n", name);
+		if (fp)
+			fclose(fp);
+		return -1;
+	}
+	if ((size_t) sb.st_size > *bufsize) {
+		unsigned char *p = realloc(*buf, sb.st_size);
+		if (!p) {
+			fclose(fp);
+			return -1;
+		}
+		*buf = p;
+		*bufsize = sb.st_size;
+	}
+	owonFilterRestart(f);		// the files come in any order, so each is filtered on its own
+	if (fread(*buf, 1, sb.st_size, fp) == (size_t) sb.st_size && owonFrameParse(frame, *buf, sb.st_size) > 0 &&
+			(!filtering || owonFilterFrame(f, frame) == 0))
+		ret = 0;
+	fclose(fp);
+	return ret;
+}
+
+void *persistWorkerThread(void *arg) {
+	struct persistWorker *w = arg;
+	struct owonFrame wframe;
+	unsigned char *buf = NULL;
+	size_t bufsize = 0;
+	int i;
+
+	memset(&wframe, 0, sizeof(wframe));
+	for (;;) {
+		pthread_mutex_lock(&persistLock);
+		i = persistNext++;
+		pthread_mutex_unlock(&persistLock);
+		if (i >= persistFileCount)
+			break;
+
+		if (persistLoad(persistFiles[i], &buf, &bufsize, &wframe, &w->filter) < 0 ||
+				owonMathFrame(&w->math, &wframe) < 0 || owonPersistFrame(&w->persist, &wframe) < 0) {
+			printf("..Skipping %s: not a usable vectorgram\n", persistFiles[i]);
+			w->failed++;
+		}
+		else
+			w->files++;
+	}
+	free(buf);
+	owonFrameFree(&wframe);
+	owonMathFree(&w->math);
+	owonFilterFree(&w->filter);
+	return NULL;
+}
+
+// the math channels take their scale from the first capture: that has to be
+// the first file named, not whichever one a worker happens to start with
+
+static void persistMathScale(char **files, int count) {
+	struct owonFrame f;
+	struct owonFilter flt;
+	unsigned char *buf = NULL;
+	size_t bufsize = 0;
+	int i, j, unset = maths.count;
+
+	memset(&f, 0, sizeof(f));
+	owonFilterInit(&flt, &filter.spec);
+	for (i = 0; i < count && unset; i++) {
+		if (persistLoad(files[i], &buf, &bufsize, &f, &flt) < 0)
+			continue;
+		owonMathFrame(&maths, &f);
+		for (j = unset = 0; j < maths.count; j++)
+			unset += !maths.ch[j].scale;
+	}
+	free(buf);
+	owonFrameFree(&f);
+	owonFilterFree(&flt);
+}
+
+void persistBatch(char **files, int count, int channel, int eye, int threads, const char *name) {
+	struct persistWorker workers[threads];
+	struct owonPersist total;
+	char outname[strlen(name)+5];
+	int i, started = 0;
+
+	persistFiles = files;
+	persistFileCount = count;
+	if (owonPersistInit(&total, channel, eye) < 0)
+		return;
+	if (maths.count)
+		persistMathScale(files, count);
+	for (i = 0; i < threads; i++) {
+		memset(&workers[i], 0, sizeof(workers[i]));
+		if (owonPersistInit(&workers[i].persist, channel, eye) < 0)
+			break;
+		owonMathClone(&workers[i].math, &maths);
+		owonFilterInit(&workers[i].filter, &filter.spec);
+		if (pthread_create(&workers[i].thread, NULL, persistWorkerThread, &workers[i])) {
+			persistWorkerThread(&workers[i]);	// out of threads: this one takes its share
+			i++;
+			break;
+		}
+		workers[i].threaded = 1;
+	}
+	started = i;
+	for (i = 0; i < started; i++)
+		if (workers[i].threaded)
+			pthread_join(workers[i].thread, NULL);
+	if (!started) {
+		printf("..Failed to set up the persistence map\n");
+		owonPersistFree(&total);
+		return;
+	}
+
+	for (i = 0; i < started; i++) {
+		owonPersistMerge(&total, &workers[i].persist);
+		owonPersistFree(&workers[i].persist);
+	}
+	printf("..Accumulated %lu captures of %s (%llu hits, %llu off screen)\n", total.frames,
+		total.channelname, (unsigned long long) total.hits, (unsigned long long) total.clipped);
+
+	sprintf(outname, "%s.pgm", name);
+	if (!owonPersistWritePgm(&total, outname))
+		printf("..Successfully written persistence map to \'%s\'!\n", outname);
+	sprintf(outname, "%s.csv", name);
+	if (!owonPersistWriteCsv(&total, outname))
+		printf("..Successfully written persistence map to \'%s\'!\n", outname);
+	owonPersistFree(&total);
+}
+
+void usage(void) {
+	printf("..Usage: owonfileread [-D uart|spi|i2c] [-b baud] [-w bits] [-P channel [-E] [-j threads] [-o name]] [-m mask] [-s [-o name]] [-S [-o name]] [-M def] [-f spec] [-d]\n");
+	printf("                      owonbinary filename(s)\n");
+	printf("        -D p   decode a serial protocol into <filename>.decode\n");
+	printf("               uart: CH1 = line; spi: CH1 = clock, CH2 = data; i2c: CH1 = SCL, CH2 = SDA\n");
+	printf("        -b n   UART baud rate (default: detect it)\n");
+	printf("        -w n   SPI bits per word (default 8)\n");
+	printf("        -P n   persistence map of channel n (1 = first) over all the files, instead of\n");
+	printf("               converting them\n");
+	printf("        -E     fold the persistence map on the recovered clock (eye diagram)\n");
+	printf("        -j n   worker threads for -P (default: one per CPU)\n");
+	printf("        -o s   name for the -P output, written as s.pgm and s.csv (default \'persistence\'),\n");
+	printf("               or the -s output, s-<channel>.roll (default \'stitched\'), or the stem for -S\n");
+	printf("        -m f   test every file against mask template f, convert only the failures\n");
+	printf("        -s     stitch the overlapping captures in the files, in the order given, into one\n");
+	printf("               continuous record per channel instead of converting them\n");
+	printf("        -S     stream the dumps in each file (\'-\' for stdin) in constant memory, however\n");
+	printf("               deep or many, into <stem>-<dump>-<channel>.txt (stem: -o or the file name)\n");
+	printf("        -M s   add a math channel defined as NAME=expression, e.g. \'PWR=CH1*CH2\', to every\n");
+	printf("               file (up to %d; see the README)\n", MATH_MAX_CHANNELS);
+	printf("        -f s   filter and decimate every file before it is converted, e.g. \'iir=50k,dec=4\':\n");
+	printf("               fir=Hz[:taps], iir=Hz[:order] (low-pass), hpf=Hz[:order], dec=N\n");
+	printf("        -d     hex dumps of the headers\n");
+}
+
 int main(int argc, char *argv[]) {
 
   FILE *fp;
+  int opt, i;
+  int persistChannel = 0, eye = 0, streaming = 0, threads = sysconf(_SC_NPROCESSORS_ONLN);
+  char *outName = NULL;
+  struct owonFilterSpec spec;
 
 //  printf("..Size of short int=%d, int=%d, long int = %d,  long long int = %d \n", (int) sizeof(short int), (int) sizeof(int), (int) sizeof(long int), (int) sizeof(long long int));
 
-  if (argc>1) {
-	  filename = malloc(strlen(argv[1]));
-	  memcpy(filename, argv[1], strlen(argv[1]));
+  owonDecoderInit(&decoder, DECODE_NONE);
+  while ((opt = getopt(argc, argv, "D:b:w:P:Ej:o:m:sSM:f:dh")) != -1) {
+	  switch (opt) {
+		case 'D' : if ((decoder.protocol = owonDecodeProtocol(optarg)) < 0) {
+					   printf("..Unknown protocol \'%s\'\n", optarg);
+					   return 0;
+				   }
+				   break;
+		case 'b' : decoder.baud = atof(optarg);
+				   break;
+		case 'w' : decoder.spiBits = atoi(optarg);
+				   if (decoder.spiBits < 1 || decoder.spiBits > 32)
+					   decoder.spiBits = 8;
+				   break;
+		case 'P' : persistChannel = atoi(optarg);
+				   break;
+		case 'E' : eye = 1;
+				   break;
+		case 'j' : threads = atoi(optarg);
+				   break;
+		case 'o' : outName = optarg;
+				   break;
+		case 'm' : if (owonMaskLoad(&mask, optarg) < 0)
+					   return 0;
+				   masking = 1;
+				   break;
+		case 's' : stitching = 1;
+				   break;
+		case 'S' : streaming = 1;
+				   break;
+		case 'M' : if (owonMathCompile(&maths, optarg) < 0)
+					   return 0;
+				   break;
+		case 'f' : if (owonFilterParse(&spec, optarg) < 0)
+					   return 0;
+				   owonFilterInit(&filter, &spec);
+				   filtering = 1;
+				   break;
+		case 'd' : debug = 1;
+				   break;
+		default  : usage();
+				   return 0;
+	  }
+  }
+  if (optind >= argc) {
+	  usage();
+	  return 0;
+  }
+
+  if (persistChannel > 0) {
+	  persistBatch(argv + optind, argc - optind, persistChannel - 1, eye, threads > 0 ? threads : 1,
+		  outName ? outName : "persistence");
+	  return 0;
   }
-  else {
-	  printf("..Usage: owonfileread owonbinary filename\n");
+
+  if (streaming) {
+	  for (i = optind; i < argc; i++)
+		  streamDumps(argv[i], outName ? outName : strcmp(argv[i], "-") ? argv[i] : "stdin");
 	  return 0;
   }
 
-  if ((fp = fopen(filename, "r")) == NULL) {
-	  printf("..Couldn\'t open %s\n", filename);
+// every file named is converted in turn, so whole archives can be handled in one run
+  if (stitching && owonStitchInit(&stitch, outName ? outName : "stitched") < 0)
 	  return 0;
+
+  for (i = optind; i < argc; i++) {
+	  filename = argv[i];
+	  if ((fp = fopen(filename, "r")) == NULL) {
+		  printf("..Couldn\'t open %s\n", filename);
+		  continue;
+	  }
+	  readOwonBinFile(fp);
+	  fclose(fp);
   }
 
-  readOwonBinFile(fp);
-  fclose(fp);
+  if (decoder.protocol)
+	  printf("..Decoded %lu symbols (%lu errors) from %lu captures, %lu not decodable\n", decoder.symbols,
+		  decoder.errors, decoder.frames, decoder.failed);
+  for (i = 0; i < stitch.count; i++)
+	  printf("..Stitched %lu captures of %s into %lu samples (%lu matched, %lu placed by time, %lu gaps)\n",
+		  stitch.ch[i].frames, stitch.ch[i].channelname, stitch.ch[i].samples,
+		  stitch.ch[i].located, stitch.ch[i].guessed, stitch.ch[i].gaps);
+  owonStitchFree(&stitch);
+  if (masking)
+	  printf("..Mask: %lu captures, %lu passed, %lu failed\n", mask.frames, mask.passed, mask.failed);
+  owonDecoderFree(&decoder);
+  owonMaskFree(&mask);
+  owonFrameFree(&frame);
+  owonMathFree(&maths);
+  owonFilterFree(&filter);
   return 0;
 }
@@ -0,0 +1,352 @@
+/*
+ * owonfilter.c
+ *				Cleans up and shrinks the captures before they are written: Butterworth
+ *				low and high-pass filters as cascades of biquads, a linear phase FIR low-pass
+ *				designed from the cutoff and the channel's t_sample, and decimation by N with
+ *				the FIR only worked out for the samples that are kept. The FIR runs four taps
+ *				at a time with SSE; the IIR sections are a recursion, one sample after the
+ *				other, and stay scalar (in double, so low cutoffs stay stable).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "owonfilter.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define FILTER_MIN_TAPS 15
+#define FILTER_MAX_DECIMATE 1000
+#define FILTER_DEFAULT_ORDER 4
+
+static double parseHz(const char *s, char **end) {
+	double v = strtod(s, end);
+
+	if (**end == 'k')
+		v *= 1e3;
+	else if (**end == 'M')
+		v *= 1e6;
+	else
+		return v;
+	(*end)++;
+	return v;
+}
+
+// "fir=20k:63,dec=4" and so on, see owonfilter.h
+
+int owonFilterParse(struct owonFilterSpec *spec, const char *text) {
+	char copy[strlen(text) + 1], *item, *save, *end;
+	double v;
+	int k;
+
+	memset(spec, 0, sizeof(*spec));
+	spec->decimate = 1;
+	strcpy(copy, text);
+	for (item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		end = item;
+		k = 0;
+		if (!strncmp(item, "dec=", 4)) {
+			v = strtod(item + 4, &end);
+			if (v >= 1 && v <= FILTER_MAX_DECIMATE && v == (unsigned) v)
+				spec->decimate = (unsigned) v;
+			else
+				end = item;
+		}
+		else if (!strncmp(item, "fir=", 4) || !strncmp(item, "iir=", 4) || !strncmp(item, "hpf=", 4)) {
+			v = parseHz(item + 4, &end);
+			if (*end == ':')
+				k = strtol(end + 1, &end, 10);
+			if (v <= 0 || k < 0 || k > (item[0] == 'f' ? FILTER_MAX_TAPS : FILTER_MAX_ORDER))
+				end = item;
+			else if (item[0] == 'f') {
+				spec->fir = v;
+				spec->taps = k;
+			}
+			else if (item[0] == 'i') {
+				spec->iir = v;
+				spec->iirOrder = k;
+			}
+			else {
+				spec->hpf = v;
+				spec->hpfOrder = k;
+			}
+		}
+		if (end == item || *end) {
+			printf("..Filter \'%s\': expected fir=Hz[:taps], iir=Hz[:order], hpf=Hz[:order] or dec=N\n", item);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void owonFilterInit(struct owonFilter *f, const struct owonFilterSpec *spec) {
+	memset(f, 0, sizeof(*f));
+	f->spec = *spec;
+}
+
+// forget what came before, so the next capture starts from steady state again -
+// for captures that aren't one stream, like the files -P shares out between threads
+
+void owonFilterRestart(struct owonFilter *f) {
+	int i;
+
+	for (i = 0; i < MAX_FRAME_CHANNELS; i++)
+		f->ch[i].primed = 0;
+}
+
+void owonFilterFree(struct owonFilter *f) {
+	struct owonFilterChannel *c;
+	int i;
+
+	for (i = 0; i < MAX_FRAME_CHANNELS; i++) {
+		c = &f->ch[i];
+		free(c->h);
+		free(c->hist);
+		free(c->buf);
+		free(c->out);
+		c->h = c->hist = c->buf = c->out = NULL;
+		c->capacity = 0;
+		c->t_sample = 0;
+	}
+}
+
+// Butterworth of the given order as order/2 biquads (RBJ cookbook forms), each
+// with the Q of one pole pair
+
+static void addButterworth(struct owonFilterChannel *c, double cutoff, int order, int highpass, double fs) {
+	double w0, alpha, cw, a0, q;
+	struct owonBiquad *bq;
+	int k;
+
+	if (cutoff >= fs / 2) {
+		printf("..Filter: %g Hz is above the Nyquist frequency of %s (%g Hz), left out\n", cutoff, c->channelname, fs / 2);
+		return;
+	}
+	order = ((order ? order : FILTER_DEFAULT_ORDER) + 1) & ~1;	// rounded up to pairs of poles
+	w0 = 2 * M_PI * cutoff / fs;
+	cw = cos(w0);
+	for (k = 0; k < order / 2 && c->nbq < FILTER_MAX_BIQUADS; k++) {
+		q = 1 / (2 * cos(M_PI * (2 * k + 1) / (2 * order)));
+		alpha = sin(w0) / (2 * q);
+		a0 = 1 + alpha;
+		bq = &c->bq[c->nbq++];
+		bq->b0 = (highpass ? (1 + cw) / 2 : (1 - cw) / 2) / a0;
+		bq->b1 = (highpass ? -(1 + cw) : 1 - cw) / a0;
+		bq->b2 = bq->b0;
+		bq->a1 = -2 * cw / a0;
+		bq->a2 = (1 - alpha) / a0;
+	}
+}
+
+// windowed sinc (Blackman), unity gain at DC. By default the window spans 8
+// periods of the cutoff, for a transition band of about 0.7 of the cutoff.
+
+static int designFir(struct owonFilterChannel *c, double cutoff, int taps, double fs) {
+	double fc = cutoff / fs, sum = 0, x, w;
+	int j, half;
+
+	if (cutoff >= fs / 2) {
+		printf("..Filter: %g Hz is above the Nyquist frequency of %s (%g Hz), left out\n", cutoff, c->channelname, fs / 2);
+		return 0;
+	}
+	if (!taps)
+		taps = 8 / fc < FILTER_MAX_TAPS ? (int) (8 / fc) : FILTER_MAX_TAPS;
+	if (taps < FILTER_MIN_TAPS)
+		taps = FILTER_MIN_TAPS;
+	taps |= 1;						// odd, so that it is centred on a sample
+	if (taps > FILTER_MAX_TAPS)
+		taps -= 2;
+	half = (taps - 1) / 2;
+
+	c->padded = (taps + 3) & ~3;
+	if ((c->h = calloc(c->padded, sizeof(float))) == NULL || (c->hist = malloc(half * sizeof(float))) == NULL) {
+		printf("..Failed to malloc(%08xh)!\n", (unsigned) (c->padded * sizeof(float)));
+		return -1;
+	}
+	for (j = 0; j < taps; j++) {
+		x = j - half;
+		w = 0.42 - 0.5 * cos(2 * M_PI * j / (taps - 1)) + 0.08 * cos(4 * M_PI * j / (taps - 1));
+		c->h[j] = (float) (w * (x ? sin(2 * M_PI * fc * x) / (M_PI * x) : 2 * fc));
+		sum += c->h[j];
+	}
+	for (j = 0; j < taps; j++)		// symmetric, so reversed is the same
+		c->h[j] /= sum;
+	c->taps = taps;
+	return 0;
+}
+
+// a new channel or a new t_sample: throw the old design and state away
+
+static int designChannel(struct owonFilter *f, struct owonFilterChannel *c, const struct channelHeader *h) {
+	const struct owonFilterSpec *spec = &f->spec;
+	double fs = 1e6 / h->t_sample, cutoff = spec->fir;
+
+	free(c->h);
+	free(c->hist);
+	c->h = c->hist = NULL;
+	c->taps = c->padded = c->nbq = c->primed = 0;
+	strcpy(c->channelname, h->channelname);
+	c->t_sample = h->t_sample;
+
+	if (spec->hpf)
+		addButterworth(c, spec->hpf, spec->hpfOrder, 1, fs);
+	if (spec->iir)
+		addButterworth(c, spec->iir, spec->iirOrder, 0, fs);
+	if (!cutoff && spec->decimate > 1)
+		cutoff = 0.4 * fs / spec->decimate;
+	return cutoff ? designFir(c, cutoff, spec->taps, fs) : 0;
+}
+
+static void toFloat(float *x, const int16_t *s, unsigned n) {
+	unsigned j = 0;
+#ifdef __SSE2__
+	for (; j + 8 <= n; j += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + j));
+		_mm_storeu_ps(x + j, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16)));
+		_mm_storeu_ps(x + j + 4, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16)));
+	}
+#endif
+	for (; j < n; j++)
+		x[j] = s[j];
+}
+
+// rounded to the nearest sample count, saturating
+
+static void fromFloat(int16_t *s, const float *x, unsigned n) {
+	unsigned j = 0;
+#ifdef __SSE2__
+	for (; j + 8 <= n; j += 8)
+		_mm_storeu_si128((__m128i *) (s + j),
+			_mm_packs_epi32(_mm_cvtps_epi32(_mm_loadu_ps(x + j)), _mm_cvtps_epi32(_mm_loadu_ps(x + j + 4))));
+#endif
+	for (; j < n; j++)
+		s[j] = x[j] > INT16_MAX ? INT16_MAX : x[j] < INT16_MIN ? INT16_MIN : (int16_t) lrintf(x[j]);
+}
+
+static float dot(const float *x, const float *h, int n) {
+	float sum = 0;
+	int j = 0;
+#ifdef __SSE2__
+	__m128 acc = _mm_setzero_ps();
+	float part[4];
+
+	for (; j + 4 <= n; j += 4)
+		acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + j), _mm_loadu_ps(h + j)));
+	_mm_storeu_ps(part, acc);
+	sum = (part[0] + part[1]) + (part[2] + part[3]);
+#endif
+	for (; j < n; j++)
+		sum += x[j] * h[j];
+	return sum;
+}
+
+// transposed direct form II, one section over the whole capture at a time
+
+static void runBiquads(struct owonFilterChannel *c, float *x, unsigned n) {
+	struct owonBiquad *bq;
+	double y, z1, z2;
+	unsigned j;
+	int s;
+
+	for (s = 0; s < c->nbq; s++) {
+		bq = &c->bq[s];
+		z1 = bq->z1;
+		z2 = bq->z2;
+		for (j = 0; j < n; j++) {
+			y = bq->b0 * x[j] + z1;
+			z1 = bq->b1 * x[j] - bq->a1 * y + z2;
+			z2 = bq->b2 * x[j] - bq->a2 * y;
+			x[j] = (float) y;
+		}
+		bq->z1 = z1;
+		bq->z2 = z2;
+	}
+}
+
+// the state each section would settle to with v on its input for ever
+
+static void primeBiquads(struct owonFilterChannel *c, double v) {
+	struct owonBiquad *bq;
+	double gain;
+	int s;
+
+	for (s = 0; s < c->nbq; s++) {
+		bq = &c->bq[s];
+		gain = (bq->b0 + bq->b1 + bq->b2) / (1 + bq->a1 + bq->a2);
+		bq->z1 = (gain - bq->b0) * v;
+		bq->z2 = (bq->b2 - bq->a2 * gain) * v;
+		v *= gain;
+	}
+}
+
+static int filterChannel(struct owonFilter *f, struct owonFilterChannel *c, struct channelHeader *h, int16_t *samples) {
+	unsigned n = h->samplecount2, N = f->spec.decimate, half = c->taps ? (c->taps - 1) / 2 : 0;
+	unsigned need = n + 2 * half + c->padded, nout = (n + N - 1) / N, j, k;
+	float *x;
+
+	if (need > c->capacity) {
+		float *buf = realloc(c->buf, need * sizeof(float)), *out = realloc(c->out, need * sizeof(float));
+		if (buf)
+			c->buf = buf;
+		if (out)
+			c->out = out;
+		if (!buf || !out) {
+			printf("..Failed to malloc(%08xh)!\n", (unsigned) (need * sizeof(float)));
+			return -1;
+		}
+		c->capacity = need;
+	}
+	x = c->buf + half;					// the history goes in front
+	toFloat(x, samples, n);
+	if (!c->primed)
+		primeBiquads(c, x[0]);
+	runBiquads(c, x, n);
+
+	if (c->taps) {
+		if (!c->primed)					// nothing before the first capture: mirror its start
+			for (j = 0; j < half; j++)		// (point symmetric, so a slope carries on)
+				c->hist[half-1-j] = 2 * x[0] - x[j + 1 < n ? j + 1 : n - 1];
+		memcpy(c->buf, c->hist, half * sizeof(float));
+		for (j = 0; j < half; j++)		// the samples after the end aren't in yet: mirror the end
+			x[n+j] = 2 * x[n-1] - x[n >= j + 2 ? n - 2 - j : 0];
+		memset(x + n + half, 0, (c->padded - c->taps) * sizeof(float));
+		for (k = 0; k < nout; k++)
+			c->out[k] = dot(c->buf + k * N, c->h, c->padded);
+		memcpy(c->hist, c->buf + n, half * sizeof(float));	// the last half of history and capture together
+	}
+	else
+		for (k = 0; k < nout; k++)
+			c->out[k] = x[k * N];
+	c->primed = 1;
+
+	fromFloat(samples, c->out, nout);
+	h->samplecount1 = h->samplecount2 = nout;
+	h->startoffset = 0;
+	h->blocklength = VECTORGRAM_BLOCK_HEADER_LENGTH - VECTORGRAM_BLOCK_HEADER_CHNAMELEN + 2 * nout;
+	h->samplePerDiv = nout / 10;
+	h->t_sample *= N;
+	return 0;
+}
+
+// filters (and decimates) every channel of the frame in place
+
+int owonFilterFrame(struct owonFilter *f, struct owonFrame *frame) {
+	struct owonFilterChannel *c;
+	struct channelHeader *h;
+	int i;
+
+	for (i = 0; i < frame->channelcount; i++) {
+		c = &f->ch[i];
+		h = &frame->headers[i];
+		if (!h->samplecount2 || h->t_sample <= 0)
+			continue;
+		if ((strcmp(c->channelname, h->channelname) || c->t_sample != h->t_sample) &&
+				designChannel(f, c, h) < 0)
+			return -1;
+		if (filterChannel(f, c, h, frame->samples[i]) < 0)
+			return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,64 @@
+// owonfilter.h - low/high-pass filtering and decimation of the captured channels
+
+#ifndef OWONFILTER_H
+#define OWONFILTER_H
+
+#include "owonframe.h"
+
+#define FILTER_MAX_TAPS 1023			  // FIR length
+#define FILTER_MAX_ORDER 8				  // of each Butterworth IIR filter
+#define FILTER_MAX_BIQUADS FILTER_MAX_ORDER	// a low-pass and a high-pass of order 8
+
+// A filter is specified as a comma separated list, e.g. "iir=50k,dec=8":
+//   fir=F[:T]   linear phase FIR low-pass at F Hz (windowed sinc, T taps)
+//   iir=F[:O]   Butterworth low-pass at F Hz of order O (default 4), as biquads
+//   hpf=F[:O]   Butterworth high-pass, to take out drift and hum
+//   dec=N       keep every Nth sample; without fir= an anti-alias FIR at 0.4/N
+//               of the sample rate is put in front
+// F takes a k or M suffix. The filters are designed from each channel's
+// t_sample and worked out again when it changes. The IIR sections run first at
+// the full rate, then the FIR, which only computes the samples decimation
+// keeps (the polyphase form) and is centred, so it doesn't shift the trace.
+//
+// The delay lines and IIR states carry over from one capture of a channel to
+// the next, so a series of captures is filtered as one stream; the first
+// capture (or one after a change of timebase, or owonFilterRestart()) starts
+// from steady state.
+
+struct owonFilterSpec {
+	double fir, iir, hpf;			// cutoffs in Hz, 0 for none
+	int taps, iirOrder, hpfOrder;	// 0 for the defaults
+	unsigned decimate;				// 1 for none
+};
+
+struct owonBiquad {
+	double b0, b1, b2, a1, a2;		// a0 normalised to 1
+	double z1, z2;					// transposed direct form II state
+};
+
+struct owonFilterChannel {
+	char channelname[4];
+	float t_sample;					// the input's, 0 until the first capture
+	int primed;
+	struct owonBiquad bq[FILTER_MAX_BIQUADS];
+	int nbq;
+	float *h;						// FIR taps reversed, padded with zeros to a multiple of 4
+	int taps, padded;				// 0 taps: no FIR
+	float *hist;					// the last (taps-1)/2 samples of the previous capture
+	float *buf;						// history, capture, end padding
+	float *out;
+	unsigned capacity;
+};
+
+struct owonFilter {
+	struct owonFilterSpec spec;
+	struct owonFilterChannel ch[MAX_FRAME_CHANNELS];
+};
+
+int owonFilterParse(struct owonFilterSpec *spec, const char *text);
+void owonFilterInit(struct owonFilter *f, const struct owonFilterSpec *spec);
+int owonFilterFrame(struct owonFilter *f, struct owonFrame *frame);
+void owonFilterRestart(struct owonFilter *f);
+void owonFilterFree(struct owonFilter *f);
+
+#endif // OWONFILTER_H
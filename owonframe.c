@@ -0,0 +1,221 @@
+/*
+ * owonframe.c
+ *				Unwraps the channel blocks of a vectorgram dump into a struct owonFrame:
+ *				one aligned int16 array per channel, oldest sample first, together with
+ *				its decoded channel header and mV scale. Everything downstream of the
+ *				parser (statistics, exporters, ...) works on frames.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include "owonframe.h"
+
+// 5mV through 5000mV (5V) per division, times the probe multiplier
+
+int owonVertSensitivity(unsigned sens_code, unsigned probex_code) {
+	static const int sensitivity[] = { 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000 };
+	int v;
+
+	if (sens_code < 0x01 || sens_code > 0x0A)
+		return -1;
+	v = sensitivity[sens_code - 1];
+	for (; probex_code > 0 && probex_code <= 3; probex_code--)
+		v *= 10;
+	return v;
+}
+
+static uint32_t le32(const unsigned char *p) {
+	uint32_t a;
+	memcpy(&a, p, sizeof(a));	// This is needed because of alignment
+	return le32toh(a);
+}
+
+static float lefloat(const unsigned char *p) {
+	uint32_t a = le32(p);
+	float f;
+	memcpy(&f, &a, sizeof(f));
+	return f;
+}
+
+// decode the 51 byte channel header at hdrBuf without printing anything, so it
+// can be used from worker threads - every tool decodes headers through this one
+// (decodeVectorgramBufferHeader() in owondump.c and owonfileread.c only adds the
+// printout). Returns -1 if it can't be a channel header.
+
+int owonDecodeChannelHeader(struct channelHeader *header, const unsigned char *hdrBuf) {
+	memcpy(header->channelname, hdrBuf, VECTORGRAM_BLOCK_HEADER_CHNAMELEN);
+	header->channelname[3] = '\0';
+	header->blocklength = le32(hdrBuf+3);
+	header->samplecount1 = le32(hdrBuf+7);
+	header->samplecount2 = le32(hdrBuf+11);
+	header->startoffset = le32(hdrBuf+15);
+	header->timebasecode = le32(hdrBuf+19);
+	header->v_position = (int) le32(hdrBuf+23);
+	header->vertsenscode = le32(hdrBuf+27);
+	header->probexcode = le32(hdrBuf+31);
+	header->t_sample = lefloat(hdrBuf+35);
+	header->frequency = lefloat(hdrBuf+39);
+	header->period = lefloat(hdrBuf+43);
+	header->unknown9 = lefloat(hdrBuf+47);
+
+	header->vertSensitivity = owonVertSensitivity(header->vertsenscode, header->probexcode);
+	header->samplePerDiv = header->samplecount1/10;
+	header->timeBase = header->t_sample * header->samplePerDiv * 1000;	// in nanoseconds
+	if (header->blocklength < VECTORGRAM_BLOCK_HEADER_LENGTH - VECTORGRAM_BLOCK_HEADER_CHNAMELEN)
+		return -1;
+	return 0;
+}
+
+// decode a whole "SPB..." dump into the frame: header walk and unwrap in one go.
+// Returns the number of channels, 0 for something that isn't a vectorgram, or
+// -1 for a damaged dump.
+
+int owonFrameParse(struct owonFrame *frame, const unsigned char *buf, unsigned size) {
+	struct channelHeader hdrs[MAX_FRAME_CHANNELS];
+	unsigned pos = VECTORGRAM_FILE_HEADER_LENGTH;
+	int count = 0;
+
+	frame->channelcount = 0;
+	if (size < VECTORGRAM_FILE_HEADER_LENGTH || buf[0] != 'S' || buf[1] != 'P' || buf[2] != 'B')
+		return 0;
+	while (pos < size && count < MAX_FRAME_CHANNELS) {
+		if (size - pos < VECTORGRAM_BLOCK_HEADER_LENGTH || owonDecodeChannelHeader(&hdrs[count], buf + pos) < 0)
+			return -1;
+		if (hdrs[count].blocklength > size - pos - VECTORGRAM_BLOCK_HEADER_CHNAMELEN)
+			return -1;
+		pos += VECTORGRAM_BLOCK_HEADER_CHNAMELEN + hdrs[count].blocklength;
+		count++;
+	}
+	return owonFrameLoad(frame, buf, size, hdrs, count);
+}
+
+int owonFrameReserve(struct owonFrame *frame, int ch, unsigned n) {
+	int16_t *p;
+
+	if (n <= frame->capacity[ch])
+		return 0;
+	p = realloc(frame->samples[ch], (n ? n : 1) * sizeof(int16_t));
+	if (!p) {
+		printf("..Failed to malloc(%08xh)!\n", (unsigned) (n * sizeof(int16_t)));
+		return -1;
+	}
+	frame->samples[ch] = p;
+	frame->capacity[ch] = n;
+	return 0;
+}
+
+// buf is the whole dump including the 10 byte "SPB..." file header, hdrs the
+// channel headers already decoded from it. Returns the number of channels
+// loaded, or -1 if a block runs off the end of the buffer.
+
+int owonFrameLoad(struct owonFrame *frame, const unsigned char *buf, unsigned size,
+		const struct channelHeader *hdrs, int count) {
+	const unsigned char *block;
+	const unsigned fields = VECTORGRAM_BLOCK_HEADER_LENGTH - VECTORGRAM_BLOCK_HEADER_CHNAMELEN;	// header bytes counted in blocklength
+	unsigned offset, n, j;
+	uint16_t s;
+	int i;
+
+	if (count > MAX_FRAME_CHANNELS)
+		count = MAX_FRAME_CHANNELS;
+	frame->channelcount = 0;
+	frame->model = size > 3 ? buf[3] : '?';
+
+	block = buf + VECTORGRAM_FILE_HEADER_LENGTH + VECTORGRAM_BLOCK_HEADER_LENGTH;	// first sample of CH1
+	for (i = 0; i < count; i++) {
+		n = hdrs[i].samplecount2;
+		if (block > buf + size || n > (unsigned) (buf + size - block) / 2 ||
+				hdrs[i].blocklength < fields || n > (hdrs[i].blocklength - fields) / 2) {
+			printf("..Channel %s: %u samples overrun the data block\n", hdrs[i].channelname, n);
+			return -1;
+		}
+		if (owonFrameReserve(frame, i, n) < 0)
+			return -1;
+
+		offset = hdrs[i].startoffset;
+		if (offset != 0 && hdrs[i].samplecount1 == hdrs[i].samplecount2)
+			offset++;	// this adjustment is very strange - but needed... (see writeTextData)
+		if (n)
+			offset %= n;
+
+		for (j = 0; j < n; j++) {
+			memcpy(&s, block + 2 * ((offset + j) < n ? offset + j : offset + j - n), 2);
+			frame->samples[i][j] = (int16_t) le16toh(s);
+		}
+
+		frame->headers[i] = hdrs[i];
+		frame->scale[i] = hdrs[i].vertSensitivity * SAMPLE_MV_PER_COUNT;
+		frame->channelcount++;
+		block += hdrs[i].blocklength + VECTORGRAM_BLOCK_HEADER_CHNAMELEN;
+	}
+	return frame->channelcount;
+}
+
+static void putle32(unsigned char *p, uint32_t a) {
+	a = htole32(a);
+	memcpy(p, &a, sizeof(a));
+}
+
+static void putlefloat(unsigned char *p, float f) {
+	uint32_t a;
+	memcpy(&a, &f, sizeof(a));
+	putle32(p, a);
+}
+
+// the reverse of owonFrameParse(): write the frame out as an "SPBx" dump, each
+// channel already unwrapped (startoffset 0). Returns the size of the dump; buf
+// may be NULL (or too small) to just find out how big it will be.
+
+unsigned owonFrameEncode(const struct owonFrame *frame, unsigned char *buf, unsigned size) {
+	const struct channelHeader *h;
+	unsigned need = VECTORGRAM_FILE_HEADER_LENGTH, n, j;
+	unsigned char *p;
+	uint16_t s;
+	int i;
+
+	for (i = 0; i < frame->channelcount; i++)
+		need += VECTORGRAM_BLOCK_HEADER_LENGTH + 2 * frame->headers[i].samplecount2;
+	if (!buf || size < need)
+		return need;
+
+	memset(buf, 0, VECTORGRAM_FILE_HEADER_LENGTH);
+	memcpy(buf, "SPB", 3);
+	buf[3] = frame->model;
+	p = buf + VECTORGRAM_FILE_HEADER_LENGTH;
+	for (i = 0; i < frame->channelcount; i++) {
+		h = &frame->headers[i];
+		n = h->samplecount2;
+		memcpy(p, h->channelname, VECTORGRAM_BLOCK_HEADER_CHNAMELEN);
+		putle32(p+3, VECTORGRAM_BLOCK_HEADER_LENGTH - VECTORGRAM_BLOCK_HEADER_CHNAMELEN + 2 * n);
+		putle32(p+7, n);
+		putle32(p+11, n);
+		putle32(p+15, 0);
+		putle32(p+19, h->timebasecode);
+		putle32(p+23, (uint32_t) h->v_position);
+		putle32(p+27, h->vertsenscode);
+		putle32(p+31, h->probexcode);
+		putlefloat(p+35, h->t_sample);
+		putlefloat(p+39, h->frequency);
+		putlefloat(p+43, h->period);
+		putlefloat(p+47, h->unknown9);
+		p += VECTORGRAM_BLOCK_HEADER_LENGTH;
+		for (j = 0; j < n; j++, p += 2) {
+			s = htole16((uint16_t) frame->samples[i][j]);
+			memcpy(p, &s, 2);
+		}
+	}
+	return need;
+}
+
+void owonFrameFree(struct owonFrame *frame) {
+	int i;
+
+	for (i = 0; i < MAX_FRAME_CHANNELS; i++) {
+		free(frame->samples[i]);
+		frame->samples[i] = NULL;
+		frame->capacity[i] = 0;
+	}
+	frame->channelcount = 0;
+}
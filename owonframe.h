@@ -0,0 +1,38 @@
+// owonframe.h - one parsed vectorgram capture with its channel samples unwrapped
+
+#ifndef OWONFRAME_H
+#define OWONFRAME_H
+
+#include <stdint.h>
+#include "owondump.h"
+
+#define MAX_FRAME_CHANNELS 10			  // same as headers[] in owondump / owonfileread
+#define SAMPLE_COUNTS_PER_DIV 25		  // one sample count is vertSensitivity / 25 mV
+#define SAMPLE_MV_PER_COUNT (1.0 / SAMPLE_COUNTS_PER_DIV)
+#define SAMPLE_FULL_SCALE 125			  // counts from the centre to the edge of the screen (5 divisions)
+
+// The channel blocks of a vectorgram hold a circular buffer of int16 samples
+// starting at startoffset. A frame holds them unwrapped into aligned arrays,
+// oldest sample first, so that the processing stages can run straight down
+// each column. The sample arrays are kept between captures and only grow.
+
+struct owonFrame {
+	int channelcount;
+	struct channelHeader headers[MAX_FRAME_CHANNELS];
+	int16_t *samples[MAX_FRAME_CHANNELS];	// headers[i].samplecount2 samples each
+	unsigned capacity[MAX_FRAME_CHANNELS];
+	double scale[MAX_FRAME_CHANNELS];		// mV per sample count
+	char model;								// 'V', 'W', 'X' from the "SPBx" file header
+	double timestamp;						// host time (s) the trace was asked for: the end of the record, 0 if unknown
+};
+
+int owonVertSensitivity(unsigned sens_code, unsigned probex_code);
+int owonDecodeChannelHeader(struct channelHeader *header, const unsigned char *hdrBuf);
+int owonFrameParse(struct owonFrame *frame, const unsigned char *buf, unsigned size);
+int owonFrameLoad(struct owonFrame *frame, const unsigned char *buf, unsigned size,
+		const struct channelHeader *hdrs, int count);
+unsigned owonFrameEncode(const struct owonFrame *frame, unsigned char *buf, unsigned size);
+int owonFrameReserve(struct owonFrame *frame, int ch, unsigned n);
+void owonFrameFree(struct owonFrame *frame);
+
+#endif // OWONFRAME_H
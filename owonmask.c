@@ -0,0 +1,190 @@
+/*
+ * owonmask.c
+ *				Mask (limit) testing for production use: every channel of every capture is
+ *				checked against an upper and a lower voltage bound loaded from a template.
+ *				The bounds are expanded once into per-sample arrays in sample counts for the
+ *				capture's sample count and timebase, and only worked out again when those
+ *				change, so the test itself is two compares per sample with no branches -
+ *				eight samples at a time with SSE2.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "owonmask.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+int owonMaskLoad(struct owonMask *mask, const char *name) {
+	struct owonMaskChannel *ch;
+	struct owonMaskPoint pt;
+	char line[256], chname[8];
+	int i, lineno = 0;
+	FILE *fp;
+
+	memset(mask, 0, sizeof(*mask));
+	if ((fp = fopen(name, "r")) == NULL) {
+		printf("..Couldn\'t open mask %s\n", name);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line))
+			continue;
+		if (sscanf(line, "timebase %lf", &mask->timebase) == 1)
+			continue;
+		if (sscanf(line, "%7s %lf %lf %lf", chname, &pt.t, &pt.lower, &pt.upper) != 4 || pt.lower > pt.upper ||
+				strlen(chname) > VECTORGRAM_BLOCK_HEADER_CHNAMELEN) {
+			printf("..Mask %s line %d: expected <channel> <divisions> <lower mV> <upper mV>\n", name, lineno);
+			fclose(fp);
+			return -1;
+		}
+		for (i = 0; i < mask->count; i++)
+			if (!strcmp(mask->ch[i].channelname, chname))
+				break;
+		if (i == mask->count) {
+			if (mask->count == MAX_FRAME_CHANNELS)
+				continue;
+			strcpy(mask->ch[i].channelname, chname);
+			mask->count++;
+		}
+		ch = &mask->ch[i];
+		if (ch->npoints == MASK_MAX_POINTS || (ch->npoints && pt.t < ch->points[ch->npoints-1].t)) {
+			printf("..Mask %s line %d: too many points, or not in time order\n", name, lineno);
+			fclose(fp);
+			return -1;
+		}
+		ch->points[ch->npoints++] = pt;
+	}
+	fclose(fp);
+	if (!mask->count)
+		printf("..Mask %s has no points\n", name);
+	return mask->count ? 0 : -1;
+}
+
+void owonMaskFree(struct owonMask *mask) {
+	int i;
+
+	for (i = 0; i < mask->count; i++) {
+		free(mask->ch[i].lo);
+		free(mask->ch[i].hi);
+		mask->ch[i].lo = mask->ch[i].hi = NULL;
+		mask->ch[i].capacity = 0;
+	}
+}
+
+static int16_t clamp16(double v) {
+	return v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : (int16_t) v;
+}
+
+// expand the template points into per-sample bounds for this channel's layout.
+// Outside the time span of the template the channel is not constrained.
+
+static int prepareBounds(struct owonMask *mask, struct owonMaskChannel *ch, const struct channelHeader *hdr,
+		double scale) {
+	double samplesPerDiv, pos0, pos1, f, lower, upper;
+	unsigned j, n = hdr->samplecount2;
+	int k = 0;
+
+	if (n > ch->capacity) {
+		int16_t *lo = realloc(ch->lo, n * sizeof(int16_t));
+		int16_t *hi = lo ? realloc(ch->hi, n * sizeof(int16_t)) : NULL;
+		if (lo)
+			ch->lo = lo;
+		if (!hi) {
+			printf("..Failed to malloc(%08xh)!\n", (unsigned) (n * sizeof(int16_t)));
+			return -1;
+		}
+		ch->hi = hi;
+		ch->capacity = n;
+	}
+	if (mask->timebase > 0 && hdr->t_sample > 0)
+		samplesPerDiv = mask->timebase / hdr->t_sample;		// both in us
+	else
+		samplesPerDiv = (double) n / MASK_SCREEN_DIVISIONS;
+
+	for (j = 0; j < n; j++) {
+		while (k < ch->npoints - 1 && j > ch->points[k+1].t * samplesPerDiv)
+			k++;
+		pos0 = ch->points[k].t * samplesPerDiv;
+		pos1 = k < ch->npoints - 1 ? ch->points[k+1].t * samplesPerDiv : pos0;
+		if (j < pos0 || j > pos1 || scale <= 0) {
+			ch->lo[j] = INT16_MIN;
+			ch->hi[j] = INT16_MAX;
+			continue;
+		}
+		f = pos1 > pos0 ? (j - pos0) / (pos1 - pos0) : 0;
+		lower = ch->points[k].lower + f * (ch->points[k < ch->npoints - 1 ? k+1 : k].lower - ch->points[k].lower);
+		upper = ch->points[k].upper + f * (ch->points[k < ch->npoints - 1 ? k+1 : k].upper - ch->points[k].upper);
+		ch->lo[j] = clamp16(ceil(lower / scale - 1e-9));
+		ch->hi[j] = clamp16(floor(upper / scale + 1e-9));
+	}
+	ch->n = n;
+	ch->timebasecode = hdr->timebasecode;
+	ch->scale = scale;
+	ch->t_sample = hdr->t_sample;
+	return 0;
+}
+
+// number of samples below lo[] or above hi[]
+
+static unsigned long countViolations(const int16_t *s, const int16_t *lo, const int16_t *hi, unsigned n) {
+	unsigned long count = 0;
+	unsigned j = 0;
+
+#ifdef __SSE2__
+	while (j + 8 <= n) {
+		__m128i acc = _mm_setzero_si128();
+		int16_t lanes[8];
+		unsigned k, block = j + 8 * 32767 < n ? j + 8 * 32767 : n;	// 16 bit lane counters
+
+		for (; j + 8 <= block; j += 8) {
+			__m128i x = _mm_loadu_si128((const __m128i *) (s + j));
+			__m128i bad = _mm_or_si128(_mm_cmplt_epi16(x, _mm_loadu_si128((const __m128i *) (lo + j))),
+										_mm_cmpgt_epi16(x, _mm_loadu_si128((const __m128i *) (hi + j))));
+			acc = _mm_sub_epi16(acc, bad);		// bad lanes are -1
+		}
+		_mm_storeu_si128((__m128i *) lanes, acc);
+		for (k = 0; k < 8; k++)
+			count += (uint16_t) lanes[k];
+	}
+#endif
+	for (; j < n; j++)
+		count += (s[j] < lo[j]) | (s[j] > hi[j]);
+	return count;
+}
+
+// test every masked channel of the frame; returns the number of samples out of
+// bounds (0 for a pass), or -1 if a masked channel is missing from the frame
+
+long owonMaskFrame(struct owonMask *mask, const struct owonFrame *frame) {
+	struct owonMaskChannel *ch;
+	unsigned long bad, total = 0;
+	int i, k;
+
+	for (k = 0; k < mask->count; k++) {
+		ch = &mask->ch[k];
+		for (i = 0; i < frame->channelcount; i++)
+			if (!strcmp(frame->headers[i].channelname, ch->channelname))
+				break;
+		if (i == frame->channelcount) {
+			printf("..Mask channel %s is not in the capture\n", ch->channelname);
+			return -1;
+		}
+		if ((ch->n != frame->headers[i].samplecount2 || ch->timebasecode != frame->headers[i].timebasecode ||
+				ch->scale != frame->scale[i] || ch->t_sample != frame->headers[i].t_sample) &&
+				prepareBounds(mask, ch, &frame->headers[i], frame->scale[i]) < 0)
+			return -1;
+		bad = countViolations(frame->samples[i], ch->lo, ch->hi, ch->n);
+		ch->violations += bad;
+		total += bad;
+	}
+	mask->frames++;
+	if (total)
+		mask->failed++;
+	else
+		mask->passed++;
+	return total;
+}
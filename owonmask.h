@@ -0,0 +1,49 @@
+// owonmask.h - mask / limit testing of captures against upper and lower bounds
+
+#ifndef OWONMASK_H
+#define OWONMASK_H
+
+#include <stdint.h>
+#include "owonframe.h"
+
+#define MASK_MAX_POINTS 256				  // per channel in a template
+#define MASK_SCREEN_DIVISIONS 10
+
+// A mask template is a text file of lines
+//
+//		<channel> <time in divisions> <lower mV> <upper mV>
+//
+// for example "CH1 0 -500 3500", with the bounds interpolated linearly between
+// the points of each channel. An optional "timebase <us/div>" line says which
+// timebase the mask was drawn for, so it still lines up when the scope's own
+// timebase differs; without it the 10 divisions span the whole capture.
+// Lines starting with '#' are comments.
+
+struct owonMaskPoint {
+	double t;					// divisions from the start of the capture
+	double lower, upper;		// mV
+};
+
+struct owonMaskChannel {
+	char channelname[4];
+	struct owonMaskPoint points[MASK_MAX_POINTS];
+	int npoints;
+	int16_t *lo, *hi;			// bounds in sample counts, one per sample of the capture
+	unsigned n, capacity;		// layout the bounds were worked out for..
+	unsigned timebasecode;
+	double scale, t_sample;
+	unsigned long violations;	// samples out of bounds, all frames
+};
+
+struct owonMask {
+	double timebase;			// us/div the template was drawn for, 0 if not given
+	struct owonMaskChannel ch[MAX_FRAME_CHANNELS];
+	int count;
+	unsigned long frames, passed, failed;
+};
+
+int owonMaskLoad(struct owonMask *mask, const char *name);
+long owonMaskFrame(struct owonMask *mask, const struct owonFrame *frame);
+void owonMaskFree(struct owonMask *mask);
+
+#endif // OWONMASK_H
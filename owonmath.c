@@ -0,0 +1,441 @@
+/*
+ * owonmath.c
+ *				Math channels worked out on the host, for the expressions the scope can't do
+ *				itself: CH1-CH2 in mV when the two channels are at different sensitivities,
+ *				CH1*CH2 for power, derivatives and integrals. Each definition is compiled
+ *				once into a postfix program; a capture is then run through the program
+ *				MATH_BLOCK samples at a time, every operation being one vector loop over the
+ *				block, and the result is added to the frame as a channel of its own so that
+ *				the text, stats, decode, mask and persistence outputs all pick it up.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "owonmath.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// recursive descent over the expression, emitting postfix operations
+
+struct mathParser {
+	const char *p;
+	struct owonMathChannel *ch;
+	int depth, maxdepth, loads;
+};
+
+static int parseSum(struct mathParser *ps);
+
+static int emit(struct mathParser *ps, enum owonMathOpcode op, int push) {
+	if (ps->ch->nops == MATH_MAX_OPS)
+		return -1;
+	ps->ch->prog[ps->ch->nops].op = op;
+	ps->ch->prog[ps->ch->nops++].k = 0;
+	ps->depth += push;
+	if (ps->depth > ps->maxdepth)
+		ps->maxdepth = ps->depth;
+	return 0;
+}
+
+static void skipSpace(struct mathParser *ps) {
+	while (isspace((unsigned char) *ps->p))
+		ps->p++;
+}
+
+static int parseTerm(struct mathParser *ps) {
+	char name[8];
+	char *end;
+	int n = 0;
+
+	skipSpace(ps);
+	if (*ps->p == '-') {
+		ps->p++;
+		return parseTerm(ps) < 0 ? -1 : emit(ps, MATH_NEG, 0);
+	}
+	if (*ps->p == '(') {
+		ps->p++;
+		if (parseSum(ps) < 0)
+			return -1;
+		skipSpace(ps);
+		if (*ps->p != ')')
+			return -1;
+		ps->p++;
+		return 0;
+	}
+	if (isdigit((unsigned char) *ps->p) || *ps->p == '.') {
+		if (emit(ps, MATH_CONST, 1) < 0)
+			return -1;
+		ps->ch->prog[ps->ch->nops-1].k = strtof(ps->p, &end);
+		ps->p = end;
+		return 0;
+	}
+	while (isalnum((unsigned char) ps->p[n]) && n < (int) sizeof(name) - 1) {
+		name[n] = ps->p[n];
+		n++;
+	}
+	name[n] = '\0';
+	if (!n)
+		return -1;
+	ps->p += n;
+	skipSpace(ps);
+	if (*ps->p == '(') {			// a function of one argument
+		enum owonMathOpcode op;
+		if (!strcmp(name, "d"))
+			op = MATH_DERIV;
+		else if (!strcmp(name, "i"))
+			op = MATH_INTEG;
+		else if (!strcmp(name, "abs"))
+			op = MATH_ABS;
+		else
+			return -1;
+		ps->p++;
+		if (parseSum(ps) < 0)
+			return -1;
+		skipSpace(ps);
+		if (*ps->p != ')')
+			return -1;
+		ps->p++;
+		return emit(ps, op, 0);
+	}
+	if (n > VECTORGRAM_BLOCK_HEADER_CHNAMELEN || emit(ps, MATH_LOAD, 1) < 0)
+		return -1;
+	strcpy(ps->ch->prog[ps->ch->nops-1].channelname, name);
+	ps->loads++;
+	return 0;
+}
+
+static int parseProduct(struct mathParser *ps) {
+	char c;
+
+	if (parseTerm(ps) < 0)
+		return -1;
+	for (;;) {
+		skipSpace(ps);
+		if ((c = *ps->p) != '*' && c != '/')
+			return 0;
+		ps->p++;
+		if (parseTerm(ps) < 0 || emit(ps, c == '*' ? MATH_MUL : MATH_DIV, -1) < 0)
+			return -1;
+	}
+}
+
+static int parseSum(struct mathParser *ps) {
+	char c;
+
+	if (parseProduct(ps) < 0)
+		return -1;
+	for (;;) {
+		skipSpace(ps);
+		if ((c = *ps->p) != '+' && c != '-')
+			return 0;
+		ps->p++;
+		if (parseProduct(ps) < 0 || emit(ps, c == '+' ? MATH_ADD : MATH_SUB, -1) < 0)
+			return -1;
+	}
+}
+
+// "NAME=expression"
+
+int owonMathCompile(struct owonMath *m, const char *definition) {
+	const char *eq = strchr(definition, '=');
+	struct owonMathChannel *ch = &m->ch[m->count];
+	struct mathParser ps;
+	int ret;
+
+	if (m->count == MATH_MAX_CHANNELS) {
+		printf("..No more than %d math channels\n", MATH_MAX_CHANNELS);
+		return -1;
+	}
+	memset(ch, 0, sizeof(*ch));
+	if (!eq || eq == definition || eq - definition > VECTORGRAM_BLOCK_HEADER_CHNAMELEN) {
+		printf("..Math channel \'%s\': expected NAME=expression, NAME up to %d characters\n",
+			definition, VECTORGRAM_BLOCK_HEADER_CHNAMELEN);
+		return -1;
+	}
+	memcpy(ch->channelname, definition, eq - definition);
+
+	ps.p = eq + 1;
+	ps.ch = ch;
+	ps.depth = ps.maxdepth = ps.loads = 0;
+	ret = parseSum(&ps);
+	skipSpace(&ps);
+	if (ret < 0 || *ps.p || ps.depth != 1 || ps.maxdepth > MATH_MAX_STACK || !ps.loads) {
+		printf("..Math channel \'%s\': can\'t make sense of it at \'%s\'\n", definition, ps.p);
+		return -1;
+	}
+	m->count++;
+	return 0;
+}
+
+// a copy of the compiled definitions with buffers of its own, for another thread
+
+void owonMathClone(struct owonMath *dst, const struct owonMath *src) {
+	int i;
+
+	*dst = *src;
+	for (i = 0; i < dst->count; i++) {
+		dst->ch[i].result = NULL;
+		dst->ch[i].capacity = 0;
+	}
+}
+
+void owonMathFree(struct owonMath *m) {
+	int i;
+
+	for (i = 0; i < m->count; i++) {
+		free(m->ch[i].result);
+		m->ch[i].result = NULL;
+		m->ch[i].capacity = 0;
+	}
+}
+
+// the block operations; a is the operand under b on the stack and receives
+// the result
+
+static void loadBlock(float *a, const int16_t *s, float scale, unsigned n) {
+	unsigned j = 0;
+#ifdef __SSE2__
+	__m128 k = _mm_set1_ps(scale);
+
+	for (; j + 8 <= n; j += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (s + j));
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);	// sign extend
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+		_mm_storeu_ps(a + j, _mm_mul_ps(_mm_cvtepi32_ps(lo), k));
+		_mm_storeu_ps(a + j + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), k));
+	}
+#endif
+	for (; j < n; j++)
+		a[j] = s[j] * scale;
+}
+
+#ifdef __SSE2__
+#define BINARY_BLOCK(vop, sop) \
+	for (; j + 4 <= n; j += 4) \
+		_mm_storeu_ps(a + j, vop(_mm_loadu_ps(a + j), _mm_loadu_ps(b + j))); \
+	for (; j < n; j++) \
+		a[j] = a[j] sop b[j]
+#else
+#define BINARY_BLOCK(vop, sop) \
+	for (; j < n; j++) \
+		a[j] = a[j] sop b[j]
+#endif
+
+static void binaryBlock(enum owonMathOpcode op, float *restrict a, const float *restrict b, unsigned n) {
+	unsigned j = 0;
+
+	switch (op) {
+	  case MATH_ADD : BINARY_BLOCK(_mm_add_ps, +); break;
+	  case MATH_SUB : BINARY_BLOCK(_mm_sub_ps, -); break;
+	  case MATH_MUL : BINARY_BLOCK(_mm_mul_ps, *); break;
+	  case MATH_DIV : BINARY_BLOCK(_mm_div_ps, /); break;
+	  default : break;
+	}
+}
+
+static void constBlock(float *a, float k, unsigned n) {
+	unsigned j;
+
+	for (j = 0; j < n; j++)
+		a[j] = k;
+}
+
+static void signBlock(enum owonMathOpcode op, float *a, unsigned n) {
+	unsigned j = 0;
+#ifdef __SSE2__
+	__m128 sign = _mm_set1_ps(-0.0f);
+
+	for (; j + 4 <= n; j += 4)
+		_mm_storeu_ps(a + j, op == MATH_NEG ? _mm_xor_ps(_mm_loadu_ps(a + j), sign)
+			: _mm_andnot_ps(sign, _mm_loadu_ps(a + j)));
+#endif
+	for (; j < n; j++)
+		a[j] = op == MATH_NEG ? -a[j] : fabsf(a[j]);
+}
+
+// the derivative and the integral carry one value over from the previous block
+
+static void derivBlock(float *a, unsigned n, float *prev, float t_sample) {
+	float last = *prev, x;
+	unsigned j;
+
+	for (j = 0; j < n; j++) {
+		x = a[j];
+		a[j] = (x - last) / t_sample;
+		last = x;
+	}
+	*prev = last;
+}
+
+static void integBlock(float *a, unsigned n, double *sum, float t_sample) {
+	double s = *sum;
+	unsigned j;
+
+	for (j = 0; j < n; j++) {
+		s += a[j] * t_sample;
+		a[j] = (float) s;
+	}
+	*sum = s;
+}
+
+static int findChannel(const struct owonFrame *frame, const char *name) {
+	int i;
+
+	for (i = 0; i < frame->channelcount; i++)
+		if (!strcmp(frame->headers[i].channelname, name))
+			return i;
+	return -1;
+}
+
+// runs one definition over the frame into ch->result; returns the number of
+// samples, or -1 if a channel it needs is missing
+
+static int runChannel(struct owonMathChannel *ch, const struct owonFrame *frame, int *first) {
+	float regs[MATH_MAX_STACK][MATH_BLOCK] __attribute__((aligned(16)));	// 8k: stays in L1
+	int src[MATH_MAX_OPS];
+	float prev[MATH_MAX_OPS];
+	double sum[MATH_MAX_OPS];
+	float t_sample = 0;
+	unsigned n = ~0u, b, len;
+	int k, sp;
+	float *p;
+
+	*first = -1;
+	for (k = 0; k < ch->nops; k++) {
+		if (ch->prog[k].op != MATH_LOAD)
+			continue;
+		if ((src[k] = findChannel(frame, ch->prog[k].channelname)) < 0)
+			return -1;
+		if (frame->headers[src[k]].samplecount2 < n)
+			n = frame->headers[src[k]].samplecount2;
+		if (*first < 0) {
+			*first = src[k];
+			t_sample = frame->headers[src[k]].t_sample;
+		}
+	}
+	if (t_sample <= 0)
+		t_sample = 1;
+
+	if (n > ch->capacity) {
+		if ((p = realloc(ch->result, n * sizeof(float))) == NULL) {
+			printf("..Failed to malloc(%08xh)!\n", (unsigned) (n * sizeof(float)));
+			return -1;
+		}
+		ch->result = p;
+		ch->capacity = n;
+	}
+	for (k = 0; k < ch->nops; k++) {
+		prev[k] = 0;
+		sum[k] = 0;
+	}
+
+	for (b = 0; b < n; b += MATH_BLOCK) {
+		len = n - b < MATH_BLOCK ? n - b : MATH_BLOCK;
+		sp = 0;
+		for (k = 0; k < ch->nops; k++)
+			switch (ch->prog[k].op) {
+			  case MATH_LOAD :
+				loadBlock(regs[sp++], frame->samples[src[k]] + b, frame->scale[src[k]], len);
+				break;
+			  case MATH_CONST :
+				constBlock(regs[sp++], ch->prog[k].k, len);
+				break;
+			  case MATH_ADD : case MATH_SUB : case MATH_MUL : case MATH_DIV :
+				binaryBlock(ch->prog[k].op, regs[sp-2], regs[sp-1], len);
+				sp--;
+				break;
+			  case MATH_NEG : case MATH_ABS :
+				signBlock(ch->prog[k].op, regs[sp-1], len);
+				break;
+			  case MATH_DERIV :
+				if (b == 0)
+					prev[k] = regs[sp-1][0];	// the first sample has no slope to speak of
+				derivBlock(regs[sp-1], len, &prev[k], t_sample);
+				break;
+			  case MATH_INTEG :
+				integBlock(regs[sp-1], len, &sum[k], t_sample);
+				break;
+			}
+		memcpy(ch->result + b, regs[0], len * sizeof(float));
+	}
+	return n;
+}
+
+// the finest 1-2-5 step of mV per count that keeps the largest value on the
+// screen, like the sensitivity of a real channel. It is picked from the first
+// capture and kept, so that every capture's counts mean the same mV to the
+// persistence map, the stitched record and the masks.
+
+static double mathScale(const float *v, unsigned n) {
+	static const double steps[] = { 1, 2, 5, 10 };
+	double peak = 0, decade;
+	unsigned j;
+
+	for (j = 0; j < n; j++)
+		if (isfinite(v[j]) && fabsf(v[j]) > peak)
+			peak = fabsf(v[j]);
+	if ((peak /= SAMPLE_FULL_SCALE) < 1e-9)
+		return 1e-9;
+	decade = pow(10, floor(log10(peak)));
+	for (j = 0; steps[j] * decade < peak; j++)
+		;
+	return steps[j] * decade;
+}
+
+// a division by zero (CH1/CH2 as CH2 crosses zero, say) leaves Inf or NaN:
+// they are put at the edge of the screen, or at 0. A later capture that
+// outgrows the first one's scale goes off the screen, as on a real channel,
+// as far as an int16 reaches. The first of each is reported.
+
+static int16_t mathSample(struct owonMathChannel *ch, float v) {
+	float c = v / ch->scale;
+
+	if (isfinite(v)) {
+		if (fabsf(c) > SAMPLE_FULL_SCALE && !ch->offscreen++)
+			printf("..Math channel %s: values off the screen at %g mV/div (set by the first capture)\n",
+				ch->channelname, ch->scale * SAMPLE_COUNTS_PER_DIV);
+		return (int16_t) lrintf(fminf(fmaxf(c, INT16_MIN), INT16_MAX));
+	}
+	if (!ch->nonfinite++)
+		printf("..Math channel %s: a value that isn\'t finite (division by zero?), clamped to %s\n",
+			ch->channelname, isnan(v) ? "0" : "the edge of the screen");
+	return isnan(v) ? 0 : v > 0 ? SAMPLE_FULL_SCALE : -SAMPLE_FULL_SCALE;
+}
+
+// adds the math channels to the frame. Returns how many were added; a
+// definition whose channels are missing from this capture is left out.
+
+int owonMathFrame(struct owonMath *m, struct owonFrame *frame) {
+	struct owonMathChannel *ch;
+	struct channelHeader *h;
+	int i, n, first, added = 0, out;
+	unsigned j;
+
+	for (i = 0; i < m->count; i++) {
+		ch = &m->ch[i];
+		if ((out = frame->channelcount) == MAX_FRAME_CHANNELS)
+			break;
+		if ((n = runChannel(ch, frame, &first)) < 0 || owonFrameReserve(frame, out, n) < 0)
+			continue;
+		if (!ch->scale)
+			ch->scale = mathScale(ch->result, n);
+		for (j = 0; j < (unsigned) n; j++)
+			frame->samples[out][j] = mathSample(ch, ch->result[j]);
+
+		h = &frame->headers[out];
+		*h = frame->headers[first];
+		strcpy(h->channelname, ch->channelname);
+		h->samplecount1 = h->samplecount2 = n;
+		h->blocklength = VECTORGRAM_BLOCK_HEADER_LENGTH - VECTORGRAM_BLOCK_HEADER_CHNAMELEN + 2 * n;
+		h->startoffset = 0;
+		h->vertsenscode = h->probexcode = 0;
+		h->vertSensitivity = (int) lrint(ch->scale * SAMPLE_COUNTS_PER_DIV);
+		frame->scale[out] = ch->scale;
+		frame->channelcount++;
+		added++;
+	}
+	return added;
+}
@@ -0,0 +1,60 @@
+// owonmath.h - host-side math channels computed from the captured ones
+
+#ifndef OWONMATH_H
+#define OWONMATH_H
+
+#include "owonframe.h"
+
+#define MATH_MAX_CHANNELS 4				  // definitions per run
+#define MATH_MAX_OPS 64					  // per expression
+#define MATH_MAX_STACK 8				  // operands pending at once
+#define MATH_BLOCK 256					  // samples evaluated per pass of the program
+
+// A math channel is defined as NAME=expression, e.g. "PWR=CH1*CH2" or
+// "DIF=CH1-CH2", where NAME is up to 3 characters. Channel names stand for the
+// channel's samples in mV; expressions use numbers, + - * /, unary minus,
+// brackets and the functions d(x) (derivative, per us), i(x) (integral over
+// the capture, times us) and abs(x). A definition may use the channels
+// defined before it.
+//
+// The expression is compiled into a short postfix program of whole-block
+// operations. Each operation runs over MATH_BLOCK samples at a time in a
+// tight (SSE) loop, so there is no interpretation per sample, and a block's
+// operands stay in L1 cache for the whole program.
+
+enum owonMathOpcode {
+	MATH_LOAD,			// push a channel, in mV
+	MATH_CONST,
+	MATH_ADD, MATH_SUB, MATH_MUL, MATH_DIV,
+	MATH_NEG, MATH_ABS,
+	MATH_DERIV, MATH_INTEG
+};
+
+struct owonMathOp {
+	enum owonMathOpcode op;
+	char channelname[4];		// MATH_LOAD
+	float k;					// MATH_CONST
+};
+
+struct owonMathChannel {
+	char channelname[4];
+	struct owonMathOp prog[MATH_MAX_OPS];
+	int nops;
+	float *result;				// the whole capture, before it is scaled to int16
+	unsigned capacity;
+	double scale;				// mV per count, from the first capture (0 until then)
+	unsigned long nonfinite;	// samples clamped for being Inf or NaN
+	unsigned long offscreen;	// samples beyond the screen at that scale
+};
+
+struct owonMath {
+	struct owonMathChannel ch[MATH_MAX_CHANNELS];
+	int count;
+};
+
+int owonMathCompile(struct owonMath *m, const char *definition);
+int owonMathFrame(struct owonMath *m, struct owonFrame *frame);
+void owonMathClone(struct owonMath *dst, const struct owonMath *src);
+void owonMathFree(struct owonMath *m);
+
+#endif // OWONMATH_H
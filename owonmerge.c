@@ -0,0 +1,337 @@
+/*
+ * owonmerge.c
+ *				Puts the captures of several scopes, used together as one wider instrument,
+ *				onto a single timeline. Every channel is renamed <scope>.<channel> so that
+ *				each scope's "CH1" stays apart, each scope's capture times are corrected by
+ *				its own clock offset, and all the channels are resampled (linearly) onto one
+ *				shared time grid and written out as a single tabulated text record.
+ *
+ *				Each channel is a stream of captures sorted by time with a cursor that only
+ *				moves forward, so every output row costs a constant amount of work per
+ *				stream and the whole merge grows linearly with the number of streams.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "owondump.h"
+#include "owonframe.h"
+
+#define MERGE_MAX_SCOPES 32
+#define MERGE_MAX_STREAMS (MERGE_MAX_SCOPES * MAX_FRAME_CHANNELS)
+#define MERGE_LABEL_LEN 15
+#define MERGE_MAX_ROWS 100000000UL		  // ~1GB of text
+
+// one capture of one channel
+
+struct mergeSegment {
+	double start;						// us from the earliest capture time
+	double t_sample;					// us
+	double scale;						// mV per count
+	unsigned n;
+	int16_t *samples;
+};
+
+// one channel of one scope, across all its captures
+
+struct mergeStream {
+	char name[MERGE_LABEL_LEN + 5];		// "<scope>.<channel>"
+	struct mergeSegment *seg;
+	int count, capacity, cursor;
+};
+
+struct mergeInput {
+	char label[MERGE_LABEL_LEN + 1];
+	const char *file;
+	double time;						// end of the record, host clock (s)
+};
+
+struct mergeOffset {
+	char label[MERGE_LABEL_LEN + 1];
+	double seconds;						// added to the scope's capture times
+};
+
+struct mergeStream streams[MERGE_MAX_STREAMS];
+int streamcount = 0;
+struct mergeOffset offsets[MERGE_MAX_SCOPES];
+int offsetcount = 0;
+
+// "[label:]file[@time]"; the label defaults to the scope's position on the
+// command line, the time to the file's modification time (owondump stamps it
+// with the time the trace was asked for)
+
+static int parseInput(char *arg, int n, struct mergeInput *in) {
+	char *colon = strchr(arg, ':'), *slash = strchr(arg, '/'), *at = strrchr(arg, '@');
+	struct stat sb;
+
+	if (colon && (!slash || colon < slash) && colon > arg && colon - arg <= MERGE_LABEL_LEN) {
+		snprintf(in->label, sizeof(in->label), "%.*s", (int) (colon - arg), arg);
+		in->file = colon + 1;
+	}
+	else {
+		snprintf(in->label, sizeof(in->label), "S%d", n + 1);
+		in->file = arg;
+	}
+	in->time = 0;
+	if (at && at > in->file) {
+		*at = '\0';
+		in->time = atof(at + 1);
+	}
+	if (stat(in->file, &sb) < 0) {
+		printf("..Couldn\'t open %s\n", in->file);
+		return -1;
+	}
+	if (!in->time)
+		in->time = sb.st_mtim.tv_sec + sb.st_mtim.tv_nsec / 1e9;
+	return 0;
+}
+
+static double scopeOffset(const char *label) {
+	int i;
+
+	for (i = 0; i < offsetcount; i++)
+		if (!strcmp(offsets[i].label, label))
+			return offsets[i].seconds;
+	return 0;
+}
+
+static struct mergeStream *findStream(const char *label, const char *channel) {
+	char name[sizeof(streams[0].name)];
+	int i;
+
+	snprintf(name, sizeof(name), "%s.%s", label, channel);
+	for (i = 0; i < streamcount; i++)
+		if (!strcmp(streams[i].name, name))
+			return &streams[i];
+	if (streamcount == MERGE_MAX_STREAMS)
+		return NULL;
+	strcpy(streams[streamcount].name, name);
+	return &streams[streamcount++];
+}
+
+static int addSegment(struct mergeStream *st, const struct mergeSegment *seg) {
+	if (st->count == st->capacity) {
+		struct mergeSegment *p = realloc(st->seg, (st->capacity * 2 + 4) * sizeof(*p));
+		if (!p) {
+			printf("..Failed to malloc(%08xh)!\n", (unsigned) ((st->capacity * 2 + 4) * sizeof(*p)));
+			return -1;
+		}
+		st->seg = p;
+		st->capacity = st->capacity * 2 + 4;
+	}
+	st->seg[st->count++] = *seg;
+	return 0;
+}
+
+static int loadInput(const struct mergeInput *in, double base, struct owonFrame *frame) {
+	struct mergeSegment seg;
+	struct mergeStream *st;
+	unsigned char *buf;
+	struct stat sb;
+	FILE *fp;
+	int i, ret;
+
+	if ((fp = fopen(in->file, "r")) == NULL || fstat(fileno(fp), &sb) < 0) {
+		printf("..Couldn\'t open %s\n", in->file);
+		return -1;
+	}
+	buf = malloc(sb.st_size);
+	if (!buf || fread(buf, 1, sb.st_size, fp) != (size_t) sb.st_size) {
+		printf("..Failed to read %s\n", in->file);
+		free(buf);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	ret = owonFrameParse(frame, buf, sb.st_size);
+	free(buf);
+	if (ret <= 0) {
+		printf("..%s is not a vectorgram dump\n", in->file);
+		return -1;
+	}
+
+	for (i = 0; i < frame->channelcount; i++) {
+		seg.n = frame->headers[i].samplecount2;
+		seg.t_sample = frame->headers[i].t_sample;
+		seg.scale = frame->scale[i];
+		if (!seg.n || seg.t_sample <= 0)
+			continue;
+		seg.start = (in->time + scopeOffset(in->label) - base) * 1e6 - seg.n * seg.t_sample;
+		if ((st = findStream(in->label, frame->headers[i].channelname)) == NULL) {
+			printf("..%s: no room for another channel, %d at most\n", in->file, MERGE_MAX_STREAMS);
+			return -1;
+		}
+		if ((seg.samples = malloc(seg.n * sizeof(int16_t))) == NULL) {
+			printf("..Failed to malloc(%08xh)!\n", (unsigned) (seg.n * sizeof(int16_t)));
+			return -1;
+		}
+		memcpy(seg.samples, frame->samples[i], seg.n * sizeof(int16_t));
+		if (addSegment(st, &seg) < 0) {
+			free(seg.samples);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int bySegmentStart(const void *a, const void *b) {
+	const struct mergeSegment *x = a, *y = b;
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// value of the stream at time t (us), linearly interpolated; t never goes
+// backwards between calls. Returns 0 where the stream has no capture.
+
+static int sampleAt(struct mergeStream *st, double t, double *mv) {
+	struct mergeSegment *seg;
+	double x, f;
+	unsigned j;
+
+	while (st->cursor < st->count &&
+			t > st->seg[st->cursor].start + (st->seg[st->cursor].n - 1) * st->seg[st->cursor].t_sample)
+		st->cursor++;
+	if (st->cursor == st->count || t < st->seg[st->cursor].start)
+		return 0;
+	seg = &st->seg[st->cursor];
+	x = (t - seg->start) / seg->t_sample;
+	j = (unsigned) x;
+	if (j >= seg->n - 1) {
+		*mv = seg->samples[seg->n - 1] * seg->scale;
+		return 1;
+	}
+	f = x - j;
+	*mv = (seg->samples[j] + f * (seg->samples[j+1] - seg->samples[j])) * seg->scale;
+	return 1;
+}
+
+// the grid runs from the earliest sample of any stream to the latest, in steps
+// of t_sample (or of the finest t_sample of the inputs if that is 0)
+
+static int writeMerged(const char *name, double base, double t_sample, int scopes, int captures) {
+	double start = HUGE_VAL, end = -HUGE_VAL, finest = HUGE_VAL, t, mv;
+	unsigned long row, rows;
+	struct mergeSegment *seg;
+	FILE *fp;
+	int i, k;
+
+	for (i = 0; i < streamcount; i++) {
+		qsort(streams[i].seg, streams[i].count, sizeof(struct mergeSegment), bySegmentStart);
+		for (k = 0; k < streams[i].count; k++) {
+			seg = &streams[i].seg[k];
+			if (seg->start < start)
+				start = seg->start;
+			if (seg->start + (seg->n - 1) * seg->t_sample > end)
+				end = seg->start + (seg->n - 1) * seg->t_sample;
+			if (seg->t_sample < finest)
+				finest = seg->t_sample;
+		}
+		streams[i].cursor = 0;
+	}
+	if (t_sample <= 0)
+		t_sample = finest;
+	if ((end - start) / t_sample >= MERGE_MAX_ROWS) {
+		printf("..The captures span %g s, too long to merge in steps of %g us (see -t)\n", (end - start) / 1e6, t_sample);
+		return -1;
+	}
+	rows = (unsigned long) ((end - start) / t_sample) + 1;
+
+	if ((fp = fopen(name, "w")) == NULL) {
+		printf("..Failed to open file \'%s\'!\n", name);
+		return -1;
+	}
+	setvbuf(fp, NULL, _IOFBF, 1 << 20);
+	fprintf(fp, "# Merged: %d captures from %d scopes, t_sample: %g us, start: %.6f s\n",
+		captures, scopes, t_sample, base + start / 1e6);
+	fprintf(fp, "# time(us)\t");
+	for (i = 0; i < streamcount; i++)
+		fprintf(fp, "%s\t", streams[i].name);
+	fprintf(fp, "\n");
+	for (row = 0; row < rows; row++) {
+		t = start + row * t_sample;
+		fprintf(fp, "%.3f\t", t - start);
+		for (i = 0; i < streamcount; i++)
+			if (sampleAt(&streams[i], t, &mv))
+				fprintf(fp, "%5.1f\t", mv);
+			else
+				fprintf(fp, "    -\t");
+		fprintf(fp, "\n");
+	}
+	if (fclose(fp)) {
+		printf("..Failed to write \'%s\'!\n", name);
+		return -1;
+	}
+	printf("..Successfully written %lu rows of %d channels to \'%s\'!\n", rows, streamcount, name);
+	return 0;
+}
+
+void usage(void) {
+	printf("..Usage: owonmerge [-o name] [-t us] [-O scope=seconds ...] [scope:]file[@time] ...\n");
+	printf("        scope  name for the channels of the file, <scope>.CH1 and so on (default S1, S2, ...\n");
+	printf("               by position); give several files the same name for a series of captures\n");
+	printf("        time   host time the trace was asked for (default: the file\'s modification time)\n");
+	printf("        -o s   output file (default \'merged.txt\')\n");
+	printf("        -t n   time step of the output in us (default: the finest t_sample of the inputs)\n");
+	printf("        -O s=n add n seconds to every capture time of scope s, for its clock offset\n");
+}
+
+int main(int argc, char *argv[]) {
+  struct mergeInput inputs[argc];
+  struct owonFrame frame;
+  char *outname = "merged.txt", *eq;
+  double base = HUGE_VAL, t_sample = 0;
+  int opt, i, k, count = 0, scopes = 0, ret = 0;
+
+  while ((opt = getopt(argc, argv, "o:t:O:h")) != -1) {
+	  switch (opt) {
+		case 'o' : outname = optarg;
+				   break;
+		case 't' : t_sample = atof(optarg);
+				   break;
+		case 'O' : if ((eq = strchr(optarg, '=')) == NULL || offsetcount == MERGE_MAX_SCOPES) {
+					   usage();
+					   return 0;
+				   }
+				   snprintf(offsets[offsetcount].label, MERGE_LABEL_LEN + 1, "%.*s", (int) (eq - optarg), optarg);
+				   offsets[offsetcount++].seconds = atof(eq + 1);
+				   break;
+		default  : usage();
+				   return 0;
+	  }
+  }
+  if (optind >= argc) {
+	  usage();
+	  return 0;
+  }
+
+  for (i = optind; i < argc; i++)
+	  if (parseInput(argv[i], i - optind, &inputs[count]) == 0) {
+		  if (inputs[count].time + scopeOffset(inputs[count].label) < base)
+			  base = inputs[count].time + scopeOffset(inputs[count].label);
+		  count++;
+	  }
+
+  memset(&frame, 0, sizeof(frame));
+  for (i = 0; i < count; i++) {
+	  if (loadInput(&inputs[i], base, &frame) < 0)
+		  continue;
+	  for (k = 0; k < i && strcmp(inputs[k].label, inputs[i].label); k++)
+		  ;
+	  scopes += k == i;
+  }
+  owonFrameFree(&frame);
+
+  if (!streamcount)
+	  printf("..Nothing to merge\n");
+  else if (writeMerged(outname, base, t_sample, scopes, count) < 0)
+	  ret = 1;
+  for (i = 0; i < streamcount; i++) {
+	  for (k = 0; k < streams[i].count; k++)
+		  free(streams[i].seg[k].samples);
+	  free(streams[i].seg);
+  }
+  return ret;
+}
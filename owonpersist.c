@@ -0,0 +1,215 @@
+/*
+ * owonpersist.c
+ *				Digital phosphor style persistence: the samples of thousands of captures are
+ *				binned into one time versus voltage hit histogram, written out as a PGM image
+ *				and a CSV density map. Optionally every capture is folded on a clock period
+ *				recovered from its own edges, which turns the histogram into an eye diagram.
+ *
+ *				Histograms are independent of each other, so batch runs give each thread its
+ *				own and add them together at the end with owonPersistMerge().
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "owonpersist.h"
+#include "owonstats.h"
+
+// tile (x/16, y/16) is stored as one contiguous 1KB block, so the run of nearby
+// columns and rows that consecutive samples land in stays in a few cache lines
+
+static inline unsigned tileIndex(unsigned width, unsigned x, unsigned y) {
+	return ((y / PERSIST_TILE) * (width / PERSIST_TILE) + x / PERSIST_TILE) * PERSIST_TILE * PERSIST_TILE
+		+ (y % PERSIST_TILE) * PERSIST_TILE + x % PERSIST_TILE;
+}
+
+int owonPersistInit(struct owonPersist *p, int channel, int eye) {
+	memset(p, 0, sizeof(*p));
+	p->channel = channel;
+	p->eye = eye;
+	p->width = PERSIST_WIDTH;
+	p->height = PERSIST_HEIGHT;
+	p->hist = calloc(p->width * p->height, sizeof(uint32_t));
+	if (!p->hist) {
+		printf("..Failed to malloc(%08xh)!\n", (unsigned) (p->width * p->height * sizeof(uint32_t)));
+		return -1;
+	}
+	return 0;
+}
+
+void owonPersistFree(struct owonPersist *p) {
+	free(p->hist);
+	p->hist = NULL;
+}
+
+// unit interval of a data signal in 16.16 fixed point samples: the narrowest
+// pulse gives a first guess, then the span between the first and last midpoint
+// crossings is divided by the number of whole bits it holds. Returns 0 if the
+// capture has too few edges; *first gets the first crossing.
+
+static uint64_t recoverUnitInterval(const int16_t *s, unsigned n, unsigned *first) {
+	struct owonBlockStats st;
+	unsigned j, last = 0, shortest = 0, crossings = 0;
+	uint64_t bits = 0;
+	int mid, above, was;
+
+	owonStatsReset(&st);
+	owonStatsBlock(&st, s, n);
+	if (st.max - st.min < 4)
+		return 0;
+	mid = (st.max + st.min) / 2;
+
+	for (was = s[0] > mid, j = 1; j < n; j++) {		// first pass: the narrowest pulse
+		above = s[j] > mid;
+		if (above == was)
+			continue;
+		if (!crossings++)
+			*first = j;
+		else if (!shortest || j - last < shortest)
+			shortest = j - last;
+		last = j;
+		was = above;
+	}
+	if (crossings < 3)
+		return 0;
+
+	for (was = s[0] > mid, last = 0, j = 1; j < n; j++) {	// second pass: whole bits per pulse
+		above = s[j] > mid;
+		if (above == was)
+			continue;
+		if (last)
+			bits += (2 * (j - last) + shortest) / (2 * shortest);
+		last = j;
+		was = above;
+	}
+	return ((uint64_t) (last - *first) << 16) / bits;
+}
+
+int owonPersistFrame(struct owonPersist *p, const struct owonFrame *frame) {
+	const int16_t *s;
+	uint64_t period, ph, xmul;
+	unsigned n, j, x, y, first = 0;
+	uint64_t clipped = 0;
+
+	if (p->channel >= frame->channelcount)
+		return -1;
+	s = frame->samples[p->channel];
+	n = frame->headers[p->channel].samplecount2;
+	if (!n)
+		return 0;
+
+	period = (uint64_t) n << 16;		// one sweep across the capture
+	ph = 0;
+	if (p->eye) {
+		uint64_t ui = recoverUnitInterval(s, n, &first);
+		if (!ui)
+			return 0;					// no clock to fold on - leave the eye alone
+		period = 2 * ui;				// two unit intervals, crossings at 1/4 and 3/4
+		ph = (period / 4 + period - (((uint64_t) first << 16) % period)) % period;
+	}
+	xmul = ((uint64_t) p->width << 32) / period;
+
+	if (!p->frames) {
+		strcpy(p->channelname, frame->headers[p->channel].channelname);
+		p->scale = frame->scale[p->channel];
+		p->t_bin = (double) period / 65536 * frame->headers[p->channel].t_sample / p->width;
+	}
+
+	for (j = 0; j < n; j++) {
+		x = (ph * xmul) >> 32;
+		y = (unsigned) (s[j] - PERSIST_LOWEST);
+		if (y < p->height)
+			p->hist[tileIndex(p->width, x, y)]++;
+		else
+			clipped++;
+		ph += 1 << 16;
+		ph -= period & -(uint64_t) (ph >= period);
+	}
+	p->hits += n - clipped;
+	p->clipped += clipped;
+	p->frames++;
+	return 0;
+}
+
+void owonPersistMerge(struct owonPersist *dst, const struct owonPersist *src) {
+	unsigned i, size = dst->width * dst->height;
+
+	if (!src->frames)
+		return;
+	if (!dst->frames) {
+		strcpy(dst->channelname, src->channelname);
+		dst->scale = src->scale;
+		dst->t_bin = src->t_bin;
+	}
+	for (i = 0; i < size; i++)
+		dst->hist[i] += src->hist[i];
+	dst->frames += src->frames;
+	dst->hits += src->hits;
+	dst->clipped += src->clipped;
+}
+
+uint32_t owonPersistHits(const struct owonPersist *p, unsigned x, unsigned y) {
+	return p->hist[tileIndex(p->width, x, y)];
+}
+
+static uint32_t maxHits(const struct owonPersist *p) {
+	unsigned i, size = p->width * p->height;
+	uint32_t max = 0;
+
+	for (i = 0; i < size; i++)
+		if (p->hist[i] > max)
+			max = p->hist[i];
+	return max;
+}
+
+// 8 bit greyscale, highest voltage at the top, log scaled so that rare hits
+// still show up next to the trace itself
+
+void owonPersistPrintPgm(const struct owonPersist *p, FILE *fp) {
+	unsigned x, y;
+	double k = maxHits(p) ? 255 / log1p(maxHits(p)) : 0;
+
+	fprintf(fp, "P5\n# %s: %lu captures, %g us and %g mV per pixel\n%u %u\n255\n",
+		p->channelname, p->frames, p->t_bin, p->scale, p->width, p->height);
+	for (y = p->height; y-- > 0; )
+		for (x = 0; x < p->width; x++)
+			fputc((int) (log1p(owonPersistHits(p, x, y)) * k + 0.5), fp);
+}
+
+// hit counts with the voltage of each row in the first column and the time of
+// each column in the first row
+
+void owonPersistPrintCsv(const struct owonPersist *p, FILE *fp) {
+	unsigned x, y;
+
+	fprintf(fp, "mV\\us");
+	for (x = 0; x < p->width; x++)
+		fprintf(fp, ",%g", x * p->t_bin);
+	fprintf(fp, "\n");
+	for (y = p->height; y-- > 0; ) {
+		fprintf(fp, "%g", ((int) y + PERSIST_LOWEST) * p->scale);
+		for (x = 0; x < p->width; x++)
+			fprintf(fp, ",%u", owonPersistHits(p, x, y));
+		fprintf(fp, "\n");
+	}
+}
+
+static int writeFile(const struct owonPersist *p, const char *name, void (*print)(const struct owonPersist *, FILE *)) {
+	FILE *fp;
+
+	if ((fp = fopen(name, "w")) == NULL) {
+		printf("..Failed to open file \'%s\'!\n", name);
+		return -1;
+	}
+	print(p, fp);
+	return fclose(fp);
+}
+
+int owonPersistWritePgm(const struct owonPersist *p, const char *name) {
+	return writeFile(p, name, owonPersistPrintPgm);
+}
+
+int owonPersistWriteCsv(const struct owonPersist *p, const char *name) {
+	return writeFile(p, name, owonPersistPrintCsv);
+}
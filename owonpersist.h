@@ -0,0 +1,42 @@
+// owonpersist.h - persistence (time x voltage hit histogram) and eye diagrams
+
+#ifndef OWONPERSIST_H
+#define OWONPERSIST_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "owonframe.h"
+
+#define PERSIST_TILE 16					  // histogram is stored in 16x16 tiles of hit counters
+#define PERSIST_WIDTH 512				  // time bins across one capture (or one eye)
+#define PERSIST_HEIGHT 256				  // voltage bins, one per sample count
+#define PERSIST_LOWEST (-PERSIST_HEIGHT/2)  // sample count of the bottom row
+
+// The histogram has one row per sample count, so binning a sample is a single
+// add. Time is a 16.16 fixed point walk across the width (or, for an eye
+// diagram, across two recovered unit intervals), so the inner loop has no
+// floating point and no division.
+
+struct owonPersist {
+	int channel;				// index of the channel in the frame
+	int eye;					// fold on the recovered clock instead of the capture length
+	unsigned width, height;		// multiples of PERSIST_TILE
+	uint32_t *hist;
+	unsigned long frames;
+	uint64_t hits, clipped;
+	char channelname[4];
+	double scale;				// mV per row, from the first frame
+	double t_bin;				// us per column, from the first frame
+};
+
+int owonPersistInit(struct owonPersist *p, int channel, int eye);
+int owonPersistFrame(struct owonPersist *p, const struct owonFrame *frame);
+void owonPersistMerge(struct owonPersist *dst, const struct owonPersist *src);
+uint32_t owonPersistHits(const struct owonPersist *p, unsigned x, unsigned y);
+void owonPersistPrintPgm(const struct owonPersist *p, FILE *fp);
+void owonPersistPrintCsv(const struct owonPersist *p, FILE *fp);
+int owonPersistWritePgm(const struct owonPersist *p, const char *name);
+int owonPersistWriteCsv(const struct owonPersist *p, const char *name);
+void owonPersistFree(struct owonPersist *p);
+
+#endif // OWONPERSIST_H
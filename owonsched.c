@@ -0,0 +1,123 @@
+/*
+ * owonsched.c
+ *				Timebase-aware polling scheduler for continuous captures. Each scope in
+ *				usb_locks[] is only asked for a new trace once its previous acquisition
+ *				period (samples x t_sample, or the timebase code when t_sample is unusable)
+ *				has elapsed, so a scope at 100s/div isn't hammered like one at 5ns/div and
+ *				several scopes on one host controller share the bus fairly.
+*/
+
+#include <time.h>
+#include <math.h>
+#include "owonsched.h"
+
+// monotonic host time in seconds - wall clock jumps must not stall the poll loop
+
+double owonNow(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// wall clock time in seconds, for the timestamps that go out with the captures
+
+double owonWallClock(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the timebase codes run 5ns, 10ns, 25ns, 50ns ... 100s per division, i.e. the
+// mantissas 5, 10, 25 repeating every decade (the table that owonfileread.c used to carry)
+
+double owonTimebaseSeconds(unsigned timebasecode) {
+	static const double mantissa[3] = { 5e-9, 10e-9, 25e-9 };
+	double t;
+	unsigned i;
+
+	if (timebasecode > 0x1f)
+		return -1;
+	t = mantissa[timebasecode % 3];
+	for (i = 0; i < timebasecode / 3; i++)
+		t *= 10;
+	return t;
+}
+
+// how long the scope needs to fill one screen of samples on its slowest channel
+
+double owonAcquisitionPeriod(const struct channelHeader *hdrs, int count) {
+	double period = SCHED_MIN_PERIOD;
+	double p;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (hdrs[i].t_sample > 0 && isfinite(hdrs[i].t_sample) && hdrs[i].samplecount1)
+			p = hdrs[i].samplecount1 * (double) hdrs[i].t_sample / 1e6;	// t_sample is in us
+		else
+			p = owonTimebaseSeconds(hdrs[i].timebasecode) * SCHED_SCREEN_DIVISIONS;
+		if (p > period)
+			period = p;
+	}
+	return period;
+}
+
+void owonSchedAdd(struct owonSchedEntry *entry, int lock, double now) {
+	entry->lock = lock;
+	entry->due = now;			// nothing known yet - poll it straight away
+	entry->period = SCHED_MIN_PERIOD;
+	entry->backoff = 0;
+	entry->captures = 0;
+	entry->failures = 0;
+	entry->idle = 0;
+}
+
+// pick the scope to poll next. Of the scopes that are due, the one that has been
+// waiting longest goes first, and on a tie the one with fewer captures - so fast
+// timebases round-robin with each other instead of starving the slow ones.
+// Returns -1 and the time to sleep in *wait if nobody is due yet (or, with
+// *wait left at -1, if every scope is idle).
+
+int owonSchedNext(const struct owonSchedEntry *sched, int count, double now, double *wait) {
+	int i, best = -1;
+	double earliest;
+
+	*wait = -1;
+	for (i = 0; i < count; i++) {
+		if (sched[i].idle)
+			continue;
+		if (best < 0 || sched[i].due < sched[best].due ||
+				(sched[i].due == sched[best].due && sched[i].captures < sched[best].captures))
+			best = i;
+	}
+	if (best < 0)
+		return -1;
+
+	earliest = sched[best].due;
+	if (earliest > now) {
+		*wait = earliest - now;
+		return -1;
+	}
+	*wait = 0;
+	return best;
+}
+
+// a capture that began at 'started' returned these headers: the next useful trace
+// is one acquisition period after the trigger of this one
+
+void owonSchedCaptured(struct owonSchedEntry *entry, const struct channelHeader *hdrs, int count,
+		double started) {
+	entry->period = owonAcquisitionPeriod(hdrs, count);
+	entry->due = started + entry->period;
+	entry->backoff = 0;
+	entry->captures++;
+}
+
+void owonSchedFailed(struct owonSchedEntry *entry, double now) {
+	entry->backoff = entry->backoff ? entry->backoff * 2 : SCHED_FAIL_BACKOFF;
+	if (entry->backoff > SCHED_MAX_BACKOFF)
+		entry->backoff = SCHED_MAX_BACKOFF;
+	entry->due = now + entry->backoff;
+	entry->failures++;
+}
@@ -0,0 +1,36 @@
+// owonsched.h - timebase-aware polling scheduler for continuous owondump captures
+
+#ifndef OWONSCHED_H
+#define OWONSCHED_H
+
+#include "owondump.h"
+
+#define SCHED_SCREEN_DIVISIONS 10		  // horizontal divisions across one acquisition
+#define SCHED_MIN_PERIOD 0.0			  // fast timebases are polled as fast as USB allows
+#define SCHED_FAIL_BACKOFF 0.5			  // seconds to leave a scope alone after a failed read
+#define SCHED_MAX_BACKOFF 8.0
+
+// one entry per scope in usb_locks[], carried across the whole continuous session
+
+struct owonSchedEntry {
+	int lock;				// index of the scope in usb_locks[]
+	double due;				// host time (s) at which the scope has a fresh acquisition for us
+	double period;			// acquisition period taken from the last channel headers (s)
+	double backoff;			// extra delay after failed reads (s)
+	unsigned long captures;	// successful reads so far
+	unsigned long failures;	// failed reads so far
+	int idle;				// finished or unplugged - not to be polled
+};
+
+double owonNow(void);
+double owonWallClock(void);
+double owonTimebaseSeconds(unsigned timebasecode);
+double owonAcquisitionPeriod(const struct channelHeader *hdrs, int count);
+
+void owonSchedAdd(struct owonSchedEntry *entry, int lock, double now);
+int owonSchedNext(const struct owonSchedEntry *sched, int count, double now, double *wait);
+void owonSchedCaptured(struct owonSchedEntry *entry, const struct channelHeader *hdrs, int count,
+		double started);
+void owonSchedFailed(struct owonSchedEntry *entry, double now);
+
+#endif // OWONSCHED_H
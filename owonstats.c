@@ -0,0 +1,196 @@
+/*
+ * owonstats.c
+ *				Vmin / Vmax / Vpp / mean / RMS for every channel of a capture, worked out
+ *				in a single pass over each int16 block while it is being exported, plus
+ *				running statistics across all the captures of a continuous session.
+ *
+ *				The block pass keeps everything in integer sample counts (min, max, sum,
+ *				sum of squares) and only converts to mV with vertSensitivity at the end.
+ *				With SSE2 it handles eight samples per instruction.
+*/
+
+#include <string.h>
+#include <math.h>
+#include "owonstats.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+void owonStatsReset(struct owonBlockStats *st) {
+	st->n = 0;
+	st->min = INT16_MAX;
+	st->max = INT16_MIN;
+	st->sum = 0;
+	st->sumsq = 0;
+}
+
+void owonStatsBlock(struct owonBlockStats *st, const int16_t *samples, unsigned n) {
+	unsigned j = 0;
+	int min = st->min, max = st->max;
+	int64_t sum = 0;
+	uint64_t sumsq = 0;
+
+#ifdef __SSE2__
+	if (n >= 8) {
+		const __m128i ones = _mm_set1_epi16(1);
+		const __m128i zero = _mm_setzero_si128();
+		__m128i vmin = _mm_set1_epi16(INT16_MAX), vmax = _mm_set1_epi16(INT16_MIN);
+		__m128i vsum = zero, vsq = zero;
+		int32_t lanes[4];
+		int16_t m[8];
+		unsigned chunk = 0;
+		int k;
+
+		for (; j + 8 <= n; j += 8) {
+			__m128i x = _mm_loadu_si128((const __m128i *) (samples + j));
+			__m128i sq = _mm_madd_epi16(x, x);		// pairs of squares, at most 2^31 - fits unsigned
+			vmin = _mm_min_epi16(vmin, x);
+			vmax = _mm_max_epi16(vmax, x);
+			vsum = _mm_add_epi32(vsum, _mm_madd_epi16(x, ones));
+			vsq = _mm_add_epi64(vsq, _mm_unpacklo_epi32(sq, zero));
+			vsq = _mm_add_epi64(vsq, _mm_unpackhi_epi32(sq, zero));
+			if (++chunk == 16384) {			// flush the 32 bit sums before they can overflow
+				_mm_storeu_si128((__m128i *) lanes, vsum);
+				sum += (int64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+				vsum = zero;
+				chunk = 0;
+			}
+		}
+		_mm_storeu_si128((__m128i *) lanes, vsum);
+		sum += (int64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		{
+			uint64_t q[2];
+			_mm_storeu_si128((__m128i *) q, vsq);
+			sumsq += q[0] + q[1];
+		}
+		_mm_storeu_si128((__m128i *) m, vmin);
+		for (k = 0; k < 8; k++)
+			if (m[k] < min)
+				min = m[k];
+		_mm_storeu_si128((__m128i *) m, vmax);
+		for (k = 0; k < 8; k++)
+			if (m[k] > max)
+				max = m[k];
+	}
+#endif
+	for (; j < n; j++) {
+		int s = samples[j];
+		min = s < min ? s : min;
+		max = s > max ? s : max;
+		sum += s;
+		sumsq += (uint64_t) (s * s);
+	}
+
+	st->n += n;
+	st->min = min;
+	st->max = max;
+	st->sum += sum;
+	st->sumsq += sumsq;
+}
+
+void owonStatsScale(struct owonChannelStats *out, const struct owonBlockStats *st, double scale) {
+	memset(out, 0, sizeof(*out));
+	out->n = st->n;
+	if (!st->n)
+		return;
+	out->vmin = (scale < 0 ? st->max : st->min) * scale;	// unknown sensitivity codes decode to -1
+	out->vmax = (scale < 0 ? st->min : st->max) * scale;
+	out->vpp = out->vmax - out->vmin;
+	out->mean = (double) st->sum / st->n * scale;
+	out->rms = sqrt((double) st->sumsq / st->n) * fabs(scale);
+}
+
+// one pass over every channel of the frame; out[] has frame->channelcount entries
+
+void owonStatsFrame(struct owonChannelStats *out, const struct owonFrame *frame) {
+	struct owonBlockStats st;
+	int i;
+
+	for (i = 0; i < frame->channelcount; i++) {
+		owonStatsReset(&st);
+		owonStatsBlock(&st, frame->samples[i], frame->headers[i].samplecount2);
+		owonStatsScale(&out[i], &st, frame->scale[i]);
+	}
+}
+
+// merge one block into the running statistics (Chan et al.'s pairwise form of
+// Welford's update, so a whole block costs the same as a single sample)
+
+void owonRunningAdd(struct owonRunningStats *run, const char *channelname, const struct owonChannelStats *st) {
+	double delta, m2, n;
+
+	if (!st->n)
+		return;
+	if (!run->n) {
+		strncpy(run->channelname, channelname, sizeof(run->channelname) - 1);
+		run->channelname[sizeof(run->channelname) - 1] = '\0';
+		run->vmin = st->vmin;
+		run->vmax = st->vmax;
+	}
+	m2 = (st->rms * st->rms - st->mean * st->mean) * st->n;
+	if (m2 < 0)
+		m2 = 0;
+	n = (double) run->n + st->n;
+	delta = st->mean - run->mean;
+	run->mean += delta * st->n / n;
+	run->m2 += m2 + delta * delta * run->n * st->n / n;
+	run->n += st->n;
+	if (st->vmin < run->vmin)
+		run->vmin = st->vmin;
+	if (st->vmax > run->vmax)
+		run->vmax = st->vmax;
+	run->frames++;
+}
+
+// run[] holds MAX_FRAME_CHANNELS slots matched to the frame's channels by name
+
+void owonRunningUpdate(struct owonRunningStats *run, const struct owonFrame *frame, const struct owonChannelStats *st) {
+	int i, k;
+
+	for (i = 0; i < frame->channelcount; i++) {
+		for (k = 0; k < MAX_FRAME_CHANNELS; k++)
+			if (!run[k].n || !strcmp(run[k].channelname, frame->headers[i].channelname))
+				break;
+		if (k < MAX_FRAME_CHANNELS)
+			owonRunningAdd(&run[k], frame->headers[i].channelname, &st[i]);
+	}
+}
+
+double owonRunningStddev(const struct owonRunningStats *run) {
+	return run->n ? sqrt(run->m2 / run->n) : 0;
+}
+
+// "# CH1 Vmin: ..." lines for the header of the tabulated text output
+
+void owonStatsPrintHeader(FILE *fp, const struct owonFrame *frame, const struct owonChannelStats *st) {
+	int i;
+
+	for (i = 0; i < frame->channelcount; i++)
+		fprintf(fp, "# %s Vmin: %.1f Vmax: %.1f Vpp: %.1f mean: %.2f rms: %.2f (mV)\n",
+			frame->headers[i].channelname, st[i].vmin, st[i].vmax, st[i].vpp, st[i].mean, st[i].rms);
+}
+
+// tab separated summary, one line per channel; run may be NULL for a single capture
+
+void owonStatsWriteSummary(FILE *fp, const struct owonFrame *frame, const struct owonChannelStats *st,
+		const struct owonRunningStats *run) {
+	const struct owonRunningStats *r;
+	int i, k;
+
+	fprintf(fp, "# channel\tsamples\tvmin_mv\tvmax_mv\tvpp_mv\tmean_mv\trms_mv"
+		"\tframes\trun_samples\trun_vmin_mv\trun_vmax_mv\trun_mean_mv\trun_stddev_mv\n");
+	for (i = 0; i < frame->channelcount; i++) {
+		fprintf(fp, "%s\t%llu\t%.1f\t%.1f\t%.1f\t%.3f\t%.3f", frame->headers[i].channelname,
+			(unsigned long long) st[i].n, st[i].vmin, st[i].vmax, st[i].vpp, st[i].mean, st[i].rms);
+		r = NULL;
+		for (k = 0; run && k < MAX_FRAME_CHANNELS; k++)
+			if (run[k].n && !strcmp(run[k].channelname, frame->headers[i].channelname))
+				r = &run[k];
+		if (r)
+			fprintf(fp, "\t%lu\t%llu\t%.1f\t%.1f\t%.3f\t%.3f\n", r->frames, (unsigned long long) r->n,
+				r->vmin, r->vmax, r->mean, owonRunningStddev(r));
+		else
+			fprintf(fp, "\t1\t%llu\t%.1f\t%.1f\t%.3f\t%.3f\n", (unsigned long long) st[i].n,
+				st[i].vmin, st[i].vmax, st[i].mean, sqrt(fabs(st[i].rms * st[i].rms - st[i].mean * st[i].mean)));
+	}
+}
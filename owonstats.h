@@ -0,0 +1,52 @@
+// owonstats.h - per-channel voltage statistics for owondump and owonfileread
+
+#ifndef OWONSTATS_H
+#define OWONSTATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "owonframe.h"
+
+// raw accumulators over a block of sample counts - blocks can be fed in
+// pieces, so a channel need not be in memory all at once
+
+struct owonBlockStats {
+	uint64_t n;
+	int min, max;
+	int64_t sum;
+	uint64_t sumsq;
+};
+
+// the same block in mV
+
+struct owonChannelStats {
+	uint64_t n;
+	double vmin, vmax, vpp;
+	double mean, rms;
+};
+
+// Welford style running statistics over every sample of every capture of one
+// channel, merged a block at a time - constant memory however long the session
+
+struct owonRunningStats {
+	char channelname[4];
+	unsigned long frames;
+	uint64_t n;
+	double mean, m2;
+	double vmin, vmax;
+};
+
+void owonStatsReset(struct owonBlockStats *st);
+void owonStatsBlock(struct owonBlockStats *st, const int16_t *samples, unsigned n);
+void owonStatsScale(struct owonChannelStats *out, const struct owonBlockStats *st, double scale);
+void owonStatsFrame(struct owonChannelStats *out, const struct owonFrame *frame);
+
+void owonRunningAdd(struct owonRunningStats *run, const char *channelname, const struct owonChannelStats *st);
+void owonRunningUpdate(struct owonRunningStats *run, const struct owonFrame *frame, const struct owonChannelStats *st);
+double owonRunningStddev(const struct owonRunningStats *run);
+
+void owonStatsPrintHeader(FILE *fp, const struct owonFrame *frame, const struct owonChannelStats *st);
+void owonStatsWriteSummary(FILE *fp, const struct owonFrame *frame, const struct owonChannelStats *st,
+		const struct owonRunningStats *run);
+
+#endif // OWONSTATS_H
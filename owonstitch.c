@@ -0,0 +1,319 @@
+/*
+ * owonstitch.c
+ *				Stitches the overlapping screenfuls that repeated captures of a slow, rolling
+ *				timebase return into one continuous record per channel. The overlap between a
+ *				capture and the one before it is where their normalised cross-correlation
+ *				peaks; the correlation for every shift at once comes from one complex FFT of
+ *				both captures packed together and one inverse FFT, O(n log n) instead of the
+ *				O(n^2) of trying each shift in turn. The host timestamps and t_sample say
+ *				roughly where the peak must be, so only shifts around that are considered,
+ *				and the guess is used on its own when the trace is too featureless to match.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "owonstitch.h"
+
+int owonStitchInit(struct owonStitch *st, const char *stem) {
+	memset(st, 0, sizeof(*st));
+	if ((st->stem = strdup(stem)) == NULL) {
+		printf("..Failed to malloc(%08xh)!\n", (unsigned) strlen(stem) + 1);
+		return -1;
+	}
+	return 0;
+}
+
+void owonStitchSetSink(struct owonStitch *st, owonStitchSink sink, void *ctx) {
+	st->sink = sink;
+	st->ctx = ctx;
+}
+
+void owonStitchFree(struct owonStitch *st) {
+	int i;
+
+	for (i = 0; i < st->count; i++) {
+		if (st->ch[i].out)
+			fclose(st->ch[i].out);
+		free(st->ch[i].prev);
+		free(st->ch[i].name);
+	}
+	free(st->work);
+	free(st->twiddle);
+	free(st->energy);
+	free(st->stem);
+	memset(st, 0, sizeof(*st));
+}
+
+static int reserve(struct owonStitch *st, unsigned n) {
+	unsigned k;
+
+	if (n == st->size)
+		return 0;
+	free(st->work);
+	free(st->twiddle);
+	free(st->energy);
+	st->work = malloc(2 * n * sizeof(double));
+	st->twiddle = malloc(n * sizeof(double));
+	st->energy = malloc((n + 2) * sizeof(double));
+	if (!st->work || !st->twiddle || !st->energy) {
+		printf("..Failed to malloc(%08xh)!\n", (unsigned) (2 * n * sizeof(double)));
+		st->size = 0;
+		return -1;
+	}
+	for (k = 0; k < n / 2; k++) {
+		st->twiddle[2*k] = cos(2 * M_PI * k / n);
+		st->twiddle[2*k+1] = -sin(2 * M_PI * k / n);
+	}
+	st->size = n;
+	return 0;
+}
+
+// in-place radix-2 FFT of n interleaved complex values
+
+static void fft(double *z, const double *tw, unsigned n, int inverse) {
+	unsigned i, j, k, bit, len, half, step;
+	double wr, wi, xr, xi, t;
+
+	for (i = 1, j = 0; i < n; i++) {		// bit reversed order
+		for (bit = n >> 1; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j) {
+			t = z[2*i]; z[2*i] = z[2*j]; z[2*j] = t;
+			t = z[2*i+1]; z[2*i+1] = z[2*j+1]; z[2*j+1] = t;
+		}
+	}
+	for (len = 2; len <= n; len <<= 1) {
+		half = len / 2;
+		step = n / len;
+		for (i = 0; i < n; i += len)
+			for (k = 0; k < half; k++) {
+				double *a = z + 2 * (i + k), *b = a + 2 * half;
+				wr = tw[2*k*step];
+				wi = inverse ? -tw[2*k*step+1] : tw[2*k*step+1];
+				xr = b[0] * wr - b[1] * wi;
+				xi = b[0] * wi + b[1] * wr;
+				b[0] = a[0] - xr;
+				b[1] = a[1] - xi;
+				a[0] += xr;
+				a[1] += xi;
+			}
+	}
+}
+
+static double mean(const int16_t *s, unsigned n) {
+	double sum = 0;
+	unsigned j;
+
+	for (j = 0; j < n; j++)
+		sum += s[j];
+	return n ? sum / n : 0;
+}
+
+// the shift k in [lo, hi] at which b[j] best matches a[j + k], by normalised
+// cross-correlation over the overlap. Returns -1 if nothing could be compared.
+
+static long correlate(struct owonStitch *st, const int16_t *a, unsigned na, const int16_t *b, unsigned nb,
+		long lo, long hi, double *score) {
+	double ma = mean(a, na), mb = mean(b, nb), *z, *ea, *eb;
+	double ar, ai, br, bi, e, r;
+	unsigned n = 1, j, k, m, len;
+	long best = -1;
+
+	while (n < na + nb)						// no wrap-around for any shift
+		n <<= 1;
+	if (reserve(st, n) < 0)
+		return -1;
+	z = st->work;
+	ea = st->energy;
+	eb = st->energy + na + 1;
+
+	// a in the real part, b in the imaginary part: one FFT for both
+	for (j = 0, ea[0] = eb[0] = 0; j < n; j++) {
+		z[2*j] = j < na ? a[j] - ma : 0;
+		z[2*j+1] = j < nb ? b[j] - mb : 0;
+		if (j < na)
+			ea[j+1] = ea[j] + z[2*j] * z[2*j];
+		if (j < nb)
+			eb[j+1] = eb[j] + z[2*j+1] * z[2*j+1];
+	}
+	fft(z, st->twiddle, n, 0);
+
+	// split the spectra apart, A(k) = (Z(k) + Z*(n-k)) / 2 and B(k) = (Z(k) - Z*(n-k)) / 2i,
+	// and form A(k)B*(k). Both are spectra of real signals, so the value at n-k is the conjugate.
+	for (k = 0; k <= n / 2; k++) {
+		m = (n - k) & (n - 1);
+		ar = (z[2*k] + z[2*m]) / 2;
+		ai = (z[2*k+1] - z[2*m+1]) / 2;
+		br = (z[2*k+1] + z[2*m+1]) / 2;
+		bi = (z[2*m] - z[2*k]) / 2;
+		z[2*k] = z[2*m] = ar * br + ai * bi;
+		z[2*k+1] = ai * br - ar * bi;
+		z[2*m+1] = -z[2*k+1];
+	}
+	fft(z, st->twiddle, n, 1);
+
+	*score = -1;
+	for (k = lo; (long) k <= hi; k++) {
+		len = na - k < nb ? na - k : nb;
+		if (len < STITCH_MIN_OVERLAP || (e = (ea[k+len] - ea[k]) * eb[len]) <= 0)
+			continue;
+		r = z[2*k] / n / sqrt(e);
+		if (r > *score) {
+			*score = r;
+			best = k;
+		}
+	}
+	return best;
+}
+
+// number of samples at the start of b that the previous capture already has,
+// or -1 if the two don't overlap (or can't be lined up)
+
+static long overlap(struct owonStitch *st, struct owonStitchChannel *c, const int16_t *b, unsigned nb,
+		double timestamp) {
+	unsigned na = c->prevn;
+	double guess = 0, score;
+	long k, lo = 0, hi = (long) na - STITCH_MIN_OVERLAP, window = na / STITCH_PRIOR_WINDOW;
+	int prior = timestamp > 0 && c->timestamp > 0 && c->t_sample > 0;
+
+	if (prior) {
+		// both captures end when they were taken, so b starts this far into a
+		guess = na - (double) nb + (timestamp - c->timestamp) / (c->t_sample * 1e-6);
+		if (guess > hi)
+			return -1;
+		if (guess - window > lo)
+			lo = guess - window;
+		if (guess + window < hi)
+			hi = guess + window;
+	}
+	if (lo > hi)
+		return -1;
+	k = correlate(st, c->prev, na, b, nb, lo, hi, &score);
+	if (k >= 0 && score >= STITCH_MIN_SCORE)
+		c->located++;
+	else if (prior && guess >= 0) {
+		k = lround(guess);
+		c->guessed++;
+	}
+	else
+		return -1;
+	return na - k < nb ? na - k : nb;
+}
+
+static struct owonStitchChannel *findChannel(struct owonStitch *st, const struct owonFrame *frame, int i) {
+	struct owonStitchChannel *c;
+	char name[strlen(st->stem) + 16];
+	int k;
+
+	for (k = 0; k < st->count; k++)
+		if (!strcmp(st->ch[k].channelname, frame->headers[i].channelname))
+			return &st->ch[k];
+	if (st->count == MAX_FRAME_CHANNELS)
+		return NULL;
+	c = &st->ch[st->count];
+	sprintf(name, "%s-%s.roll", st->stem, frame->headers[i].channelname);
+	if (!st->sink && (c->out = fopen(name, "w")) == NULL) {
+		printf("..Failed to open file \'%s\'!\n", name);
+		return NULL;
+	}
+	if ((c->name = strdup(name)) == NULL) {
+		if (c->out)
+			fclose(c->out);
+		c->out = NULL;
+		return NULL;
+	}
+	printf("..Stitching %s into \'%s\'\n", frame->headers[i].channelname, name);
+	strcpy(c->channelname, frame->headers[i].channelname);
+	st->count++;
+	return c;
+}
+
+// the lines of one capture, out to the file or the sink
+
+static int emit(struct owonStitch *st, struct owonStitchChannel *c, char *data, size_t size) {
+	if (!st->sink) {
+		fwrite(data, 1, size, c->out);
+		free(data);
+		if (fflush(c->out)) {
+			c->lost = 1;
+			return -1;
+		}
+	}
+	else if (st->sink(st->ctx, c->name, data, size, c->started) < 0) {
+		c->lost = 1;
+		return -1;
+	}
+	c->started = 1;
+	return 0;
+}
+
+int owonStitchFrame(struct owonStitch *st, const struct owonFrame *frame) {
+	struct owonStitchChannel *c;
+	const int16_t *b;
+	unsigned j, nb;
+	long start;
+	int i;
+	FILE *fp;
+	char *data;
+	size_t size;
+
+	for (i = 0; i < frame->channelcount; i++) {
+		if ((c = findChannel(st, frame, i)) == NULL)
+			return -1;
+		b = frame->samples[i];
+		nb = frame->headers[i].samplecount2;
+		if ((fp = open_memstream(&data, &size)) == NULL) {
+			printf("..Failed to open a memory stream\n");
+			return -1;
+		}
+
+		if (!c->started)				// until a piece of the file has made it out
+			fprintf(fp, "# %s: %g us per sample (mV)\n", c->channelname, frame->headers[i].t_sample);
+		else if (c->lost) {			// the last piece never made it to the file
+			fprintf(fp, "# gap\n");
+			c->gaps++;
+		}
+		c->lost = 0;
+		if (c->frames && (c->t_sample != frame->headers[i].t_sample || c->scale != frame->scale[i])) {
+			if (c->started)
+				fprintf(fp, "# restart: %g us per sample\n", frame->headers[i].t_sample);
+			c->prevn = 0;
+		}
+		c->t_sample = frame->headers[i].t_sample;
+		c->scale = frame->scale[i];
+
+		start = 0;
+		if (c->prevn && (start = overlap(st, c, b, nb, frame->timestamp)) < 0) {
+			fprintf(fp, "# gap\n");
+			c->gaps++;
+			start = 0;
+		}
+		for (j = start; j < nb; j++)
+			fprintf(fp, "%5.1f\n", b[j] * c->scale);
+		if (fclose(fp) == 0)
+			emit(st, c, data, size);
+		else {
+			free(data);
+			c->lost = 1;
+		}
+		c->samples += nb - start;
+
+		if (nb > c->capacity) {
+			int16_t *p = realloc(c->prev, nb * sizeof(int16_t));
+			if (!p) {
+				printf("..Failed to malloc(%08xh)!\n", (unsigned) (nb * sizeof(int16_t)));
+				return -1;
+			}
+			c->prev = p;
+			c->capacity = nb;
+		}
+		memcpy(c->prev, b, nb * sizeof(int16_t));
+		c->prevn = nb;
+		c->timestamp = frame->timestamp;
+		c->frames++;
+	}
+	return 0;
+}
@@ -0,0 +1,56 @@
+// owonstitch.h - stitching overlapping captures into one continuous record
+
+#ifndef OWONSTITCH_H
+#define OWONSTITCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "owonframe.h"
+
+#define STITCH_MIN_OVERLAP 32			  // samples needed to trust a correlation peak
+#define STITCH_MIN_SCORE 0.8			  // normalised correlation needed to trust it at all
+#define STITCH_PRIOR_WINDOW 4			  // search +- 1/4 of a capture around the timestamp guess
+
+// At slow timebases the scope only hands over the last screenful of a rolling
+// trace, so consecutive captures overlap. The overlap of each channel with its
+// previous capture is found by cross-correlation (through an FFT), searched
+// around the shift the host timestamps and t_sample predict, and only the new
+// samples are appended to the channel's record, <stem>-<channel>.roll: one mV
+// value per line, with '#' comment lines where there was a gap or a restart.
+
+// Each capture's new lines are formatted in memory and then written out in one
+// go - to the file directly, or handed to a sink (owondump's writer thread, so
+// that a capture never waits on the disk). append is 0 for the first piece of a
+// record, which replaces any old file; data is malloc'ed and the sink's to free.
+// A sink that returns -1 has dropped the piece, and a "# gap" line marks it.
+
+typedef int (*owonStitchSink)(void *ctx, const char *name, char *data, size_t size, int append);
+
+struct owonStitchChannel {
+	char channelname[4];
+	int16_t *prev;					// previous capture of the channel
+	unsigned prevn, capacity;
+	double timestamp, t_sample, scale;
+	char *name;						// <stem>-<channel>.roll
+	FILE *out;						// without a sink
+	int started, lost;				// a piece of the file has gone out / the last one was lost
+	unsigned long frames, samples;	// captures taken in, samples written
+	unsigned long located, guessed, gaps;	// overlap found by correlation / from the timestamps only / none
+};
+
+struct owonStitch {
+	char *stem;
+	owonStitchSink sink;
+	void *ctx;
+	struct owonStitchChannel ch[MAX_FRAME_CHANNELS];
+	int count;
+	double *work, *twiddle, *energy;	// FFT and prefix sum buffers, kept between captures
+	unsigned size;					// FFT length the buffers are allocated for
+};
+
+int owonStitchInit(struct owonStitch *st, const char *stem);
+void owonStitchSetSink(struct owonStitch *st, owonStitchSink sink, void *ctx);
+int owonStitchFrame(struct owonStitch *st, const struct owonFrame *frame);
+void owonStitchFree(struct owonStitch *st);
+
+#endif // OWONSTITCH_H
@@ -0,0 +1,275 @@
+/*
+ * owonstream.c
+ *				A parser for vectorgram dumps that never needs a whole dump in memory. The
+ *				bytes come through a fixed window filled with large read()s from a file, a
+ *				pipe or stdin; headers are decoded as they arrive and the sample blocks are
+ *				handed on a window at a time, so deep-memory dumps, or any number of dumps
+ *				one after the other, go through at the speed of the disk with the same
+ *				small footprint. Unlike the in-memory walks, no length is taken on trust:
+ *				each one is checked against what the stream still holds before it is used.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "owonstream.h"
+#include "owonframe.h"
+
+#define STREAM_BLOCK_FIELDS (VECTORGRAM_BLOCK_HEADER_LENGTH - VECTORGRAM_BLOCK_HEADER_CHNAMELEN)	// header bytes counted in blocklength
+
+int owonStreamOpen(struct owonStream *s, int fd, size_t window) {
+	struct stat sb;
+
+	memset(s, 0, sizeof(*s));
+	s->fd = fd;
+	s->window = window < VECTORGRAM_BLOCK_HEADER_LENGTH ? VECTORGRAM_BLOCK_HEADER_LENGTH : window;
+	s->buf = malloc(s->window);
+	s->samples = malloc(s->window / 2 * sizeof(int16_t));
+	if (!s->buf || !s->samples) {
+		printf("..Failed to malloc(%08xh)!\n", (unsigned) s->window);
+		owonStreamClose(s);
+		return -1;
+	}
+	if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+		s->base = lseek(fd, 0, SEEK_CUR);
+		s->size = sb.st_size - s->base;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+	s->state = STREAM_AT_DUMP;
+	return 0;
+}
+
+void owonStreamClose(struct owonStream *s) {
+	free(s->buf);
+	free(s->samples);
+	s->buf = NULL;
+	s->samples = NULL;
+}
+
+// at least need bytes in the window unless the stream ends first; returns how
+// many there are
+
+static size_t fill(struct owonStream *s, size_t need) {
+	ssize_t n;
+
+	if (need > s->window)
+		need = s->window;
+	while (s->end - s->start < need && !s->eof) {
+		if (s->window - s->start < need) {	// move what is left to the front
+			memmove(s->buf, s->buf + s->start, s->end - s->start);
+			s->end -= s->start;
+			s->start = 0;
+		}
+		if ((n = read(s->fd, s->buf + s->end, s->window - s->end)) < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("..Failed to read the stream: %s\n", strerror(errno));
+			s->eof = 1;
+		}
+		else if (n == 0)
+			s->eof = 1;
+		else
+			s->end += n;
+	}
+	return s->end - s->start;
+}
+
+static void consume(struct owonStream *s, size_t n) {
+	s->start += n;
+	s->offset += n;
+}
+
+// report the damage and go looking for the next dump. The search starts again
+// just past the start of the damaged one, so a good dump that a truncated one
+// ran into isn't lost with it: from the window if it still holds that far back,
+// otherwise by seeking back in a regular file. A pipe carries on from here.
+
+static int damaged(struct owonStream *s, struct owonStreamItem *item, const char *why) {
+	uint64_t back = s->offset - s->dumpstart;
+
+	printf("..Damaged dump at offset %llu (it starts at %llu): %s\n", (unsigned long long) s->offset,
+		(unsigned long long) s->dumpstart, why);
+	item->type = STREAM_DAMAGED;
+	item->offset = s->offset;
+	s->damaged++;
+	if (back <= s->start) {
+		s->start -= back;
+		s->offset = s->dumpstart;
+	}
+	else if (s->size && lseek(s->fd, s->base + s->dumpstart, SEEK_SET) >= 0) {
+		s->start = s->end = 0;
+		s->offset = s->dumpstart;
+		s->eof = 0;
+	}
+	if (fill(s, 1))
+		consume(s, 1);				// so the search doesn't find the same "SPB" again
+	s->state = STREAM_RESYNC;
+	return 1;
+}
+
+// a channel header has to look like one before its lengths are believed
+
+static int plausible(const struct channelHeader *h) {
+	int i;
+
+	for (i = 0; i < VECTORGRAM_BLOCK_HEADER_CHNAMELEN; i++)
+		if (h->channelname[i] < '!' || h->channelname[i] > '~')
+			return 0;
+	return h->vertSensitivity > 0 && h->samplecount2 <= h->samplecount1 &&
+		(uint64_t) h->samplecount2 * 2 <= h->blocklength - STREAM_BLOCK_FIELDS;
+}
+
+static const unsigned char *findDump(const unsigned char *p, size_t n) {
+	const unsigned char *end = p + n;
+
+	for (; end - p >= 3 && (p = memchr(p, 'S', end - p - 2)) != NULL; p++)
+		if (p[1] == 'P' && p[2] == 'B')
+			return p;
+	return NULL;
+}
+
+// whether the current dump has run into the start of another: if a channel
+// header doesn't turn up where one should, either the dump ended there or it
+// was cut short and its last block swallowed the dump after it. Looked for in
+// the window, or read back from a regular file; down a pipe it can't be told.
+
+static int overran(struct owonStream *s) {
+	uint64_t back = s->offset - s->dumpstart, pos;
+	unsigned char chunk[4096];
+	ssize_t n;
+
+	if (back <= s->start)
+		return findDump(s->buf + s->start - back + 1, back - 1) != NULL;
+	if (!s->size)
+		return 0;
+	for (pos = s->dumpstart + 1; pos + 2 < s->offset; pos += n - 2) {
+		n = pread(s->fd, chunk, s->offset - pos < sizeof(chunk) ? s->offset - pos : sizeof(chunk), s->base + pos);
+		if (n < 3)
+			return 0;
+		if (findDump(chunk, n))
+			return 1;
+	}
+	return 0;
+}
+
+// the next item off the stream: 1, or 0 at the end of the stream
+
+int owonStreamNext(struct owonStream *s, struct owonStreamItem *item) {
+	const unsigned char *p;
+	size_t avail, k, j;
+	uint64_t left;
+	uint16_t v;
+
+	for (;;) {
+		item->offset = s->offset;
+		item->model = s->model;
+		item->channel = s->channel;
+		item->header = &s->header;
+
+		switch (s->state) {
+		  case STREAM_AT_DUMP :
+			if ((avail = fill(s, VECTORGRAM_FILE_HEADER_LENGTH)) == 0)
+				return 0;
+			if (avail < 3 || memcmp(s->buf + s->start, "SPB", 3)) {
+				s->state = STREAM_RESYNC;	// whatever is between dumps is skipped and counted
+				break;
+			}
+			s->dumpstart = s->offset;
+			if (avail < VECTORGRAM_FILE_HEADER_LENGTH)
+				return damaged(s, item, "truncated in the file header");
+			s->model = item->model = s->buf[s->start + 3];
+			s->channel = item->channel = 0;
+			consume(s, VECTORGRAM_FILE_HEADER_LENGTH);
+			s->state = STREAM_AT_HEADER;
+			item->type = STREAM_DUMP;
+			return 1;
+
+		  case STREAM_AT_HEADER :
+			avail = fill(s, VECTORGRAM_BLOCK_HEADER_LENGTH);
+			if (avail == 0 || (avail >= 3 && !memcmp(s->buf + s->start, "SPB", 3))) {
+				s->state = STREAM_AT_DUMP;		// no more channels: this dump is complete
+				s->dumps++;
+				item->type = STREAM_DUMP_END;
+				return 1;
+			}
+			if (avail < VECTORGRAM_BLOCK_HEADER_LENGTH)
+				return damaged(s, item, "truncated in a channel header");
+			if (owonDecodeChannelHeader(&s->header, s->buf + s->start) < 0 || !plausible(&s->header)) {
+				if (s->channel == 0 || overran(s))
+					return damaged(s, item, "the channel header doesn't add up");
+				printf("..No channel header at offset %llu, the dump is taken to end there\n",
+					(unsigned long long) s->offset);
+				s->state = STREAM_RESYNC;
+				s->dumps++;
+				item->type = STREAM_DUMP_END;
+				return 1;
+			}
+			if (s->channel == MAX_FRAME_CHANNELS)
+				return damaged(s, item, "too many channels");
+			if (s->size && (uint64_t) s->header.blocklength + VECTORGRAM_BLOCK_HEADER_CHNAMELEN > s->size - s->offset)
+				return damaged(s, item, "the channel block runs past the end of the file");
+			consume(s, VECTORGRAM_BLOCK_HEADER_LENGTH);
+			s->remaining = s->header.blocklength - STREAM_BLOCK_FIELDS;
+			s->sample = 0;
+			s->state = STREAM_IN_SAMPLES;
+			item->type = STREAM_CHANNEL;
+			return 1;
+
+		  case STREAM_IN_SAMPLES :
+			if (s->sample == s->header.samplecount2) {
+				s->state = STREAM_IN_PADDING;
+				break;
+			}
+			left = s->header.samplecount2 - s->sample;
+			avail = fill(s, left * 2 < s->window ? left * 2 : s->window);
+			k = avail / 2 < left ? avail / 2 : left;
+			if (k == 0)
+				return damaged(s, item, "truncated in the samples");
+			for (j = 0; j < k; j++) {
+				memcpy(&v, s->buf + s->start + 2 * j, 2);
+				s->samples[j] = (int16_t) le16toh(v);
+			}
+			item->type = STREAM_SAMPLES;
+			item->samples = s->samples;
+			item->count = k;
+			item->first = s->sample;
+			consume(s, 2 * k);
+			s->remaining -= 2 * k;
+			s->sample += k;
+			return 1;
+
+		  case STREAM_IN_PADDING :		// whatever the block holds after the samples
+			while (s->remaining) {
+				if ((avail = fill(s, s->remaining < s->window ? s->remaining : s->window)) == 0)
+					return damaged(s, item, "truncated in a channel block");
+				k = avail < s->remaining ? avail : s->remaining;
+				consume(s, k);
+				s->remaining -= k;
+			}
+			s->state = STREAM_AT_HEADER;
+			s->channel++;
+			item->type = STREAM_CHANNEL_END;
+			return 1;
+
+		  case STREAM_RESYNC :
+			if ((avail = fill(s, s->window)) == 0)
+				return 0;
+			if ((p = findDump(s->buf + s->start, avail)) != NULL) {
+				k = p - (s->buf + s->start);
+				s->state = STREAM_AT_DUMP;
+			}
+			else
+				k = s->eof ? avail : avail - 2;	// "SP" may be the start of the next header
+			s->skipped += k;
+			consume(s, k);
+			if (s->eof && s->start == s->end)
+				return 0;
+			break;
+		}
+	}
+}
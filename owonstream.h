@@ -0,0 +1,70 @@
+// owonstream.h - vectorgram dumps parsed on the fly from a file, pipe or stdin
+
+#ifndef OWONSTREAM_H
+#define OWONSTREAM_H
+
+#include <stdint.h>
+#include "owondump.h"
+
+#define STREAM_WINDOW (1 << 20)			  // default bytes held at once
+
+// The stream is read through a fixed window, so memory stays the same however
+// deep the dumps are and however many follow each other on the stream. Each
+// call of owonStreamNext() hands back the next item: the start of a dump, a
+// channel header, a run of that channel's samples (in the order they are
+// stored, not unwrapped), the end of the channel and the end of the dump.
+// Every length is checked against what the stream still holds - against the
+// file size up front for a regular file, as the bytes arrive for a pipe - and
+// a damaged dump is reported, dropped and the stream searched for the next
+// "SPB" header. Bytes between dumps are skipped: where a channel header should
+// follow and doesn't, the dump is taken to end there unless it holds the start
+// of another, which means it was cut short.
+
+enum owonStreamEvent {
+	STREAM_DUMP,					// model
+	STREAM_CHANNEL,					// header, channel
+	STREAM_SAMPLES,					// samples, count, first
+	STREAM_CHANNEL_END,
+	STREAM_DUMP_END,
+	STREAM_DAMAGED					// what has been handed back of this dump is incomplete
+};
+
+enum owonStreamState {
+	STREAM_AT_DUMP, STREAM_AT_HEADER, STREAM_IN_SAMPLES, STREAM_IN_PADDING, STREAM_RESYNC
+};
+
+struct owonStreamItem {
+	enum owonStreamEvent type;
+	uint64_t offset;				// in the stream
+	char model;
+	int channel;
+	const struct channelHeader *header;
+	const int16_t *samples;
+	unsigned count, first;			// first: index of samples[0] in the channel's block
+};
+
+struct owonStream {
+	int fd;
+	uint64_t size;					// of a regular file, 0 for a pipe
+	uint64_t base;					// where the stream starts in that file
+	unsigned char *buf;
+	int16_t *samples;
+	size_t window, start, end;		// buf[start..end) is unread
+	uint64_t offset;				// stream position of buf[start]
+	uint64_t dumpstart;				// ..and of the current dump
+	int eof;
+	enum owonStreamState state;
+	char model;
+	int channel;
+	struct channelHeader header;
+	uint64_t remaining;				// bytes left of the current block
+	unsigned sample;				// next sample of the current block
+	unsigned long dumps, damaged;
+	uint64_t skipped;				// bytes passed over looking for a dump
+};
+
+int owonStreamOpen(struct owonStream *s, int fd, size_t window);
+int owonStreamNext(struct owonStream *s, struct owonStreamItem *item);
+void owonStreamClose(struct owonStream *s);
+
+#endif // OWONSTREAM_H
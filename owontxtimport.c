@@ -0,0 +1,491 @@
+/*
+ * owontxtimport.c
+ *				Converts tabulated text traces - the .txt files written by owondump and
+ *				owonfileread, or the text exports of Owon's own software - back into the
+ *				scope's binary vectorgram format, two bytes a sample, which owonfileread and
+ *				the rest of the tools read directly.
+ *
+ *				The text is memory mapped and parsed in place by a hand-written number parser,
+ *				no fgets/strsep/atof. Large files are cut into pieces at line boundaries and
+ *				parsed by one thread each: a first pass counts the rows in every piece, so
+ *				that each thread knows where its rows go, and a second pass parses them.
+ *
+ *				The values are kept in integer microvolts while parsing. The scope's samples
+ *				are whole multiples of 1/25 of a division, so the coarsest standard
+ *				sensitivity that divides every value of a channel gives back the original
+ *				samples exactly.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "owondump.h"
+#include "owonframe.h"
+#include "owonsched.h"
+
+#define IMPORT_MIN_CHUNK (1 << 20)		  // don't bother splitting up less text than this per thread
+#define IMPORT_MISSING INT32_MIN		  // "-": no sample for this channel on this row
+
+char model = 'V';						  // written into the "SPBx" header, the text doesn't say
+
+struct importChunk {
+	pthread_t thread;
+	int threaded;						// 0: ran in the calling thread
+	const char *begin, *end;			// whole lines
+	unsigned long first, rows;			// rows of the file that fall in this chunk
+	int32_t **cols;						// shared column arrays, in microvolts
+	int ncols, index;					// value columns, and whether an index column comes first
+	uint32_t gcd[MAX_FRAME_CHANNELS];
+	uint32_t maxabs[MAX_FRAME_CHANNELS];
+	long last[MAX_FRAME_CHANNELS];		// last row with a value, -1 for none
+};
+
+static uint32_t gcd(uint32_t a, uint32_t b) {
+	while (b) {
+		uint32_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static const char *nextLine(const char *p, const char *end) {
+	const char *nl = memchr(p, '\n', end - p);
+	return nl ? nl + 1 : end;
+}
+
+// one value at p, in mV as written: returns 1 with *uv in microvolts, 0 for a
+// lone "-" (no sample), -1 if it isn't a number. *next is set past the token.
+
+static int parseValue(const char *p, const char *end, int32_t *uv, const char **next) {
+	int64_t m = 0;
+	int neg = 0, digits = 0, exp = 3, e = 0, eneg = 0;	// mV to uV
+
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	if (p < end && (*p == '-' || *p == '+'))
+		neg = *p++ == '-';
+	for (; p < end && isdigit((unsigned char) *p); p++, digits++)
+		if (m < 100000000000000000LL)
+			m = m * 10 + (*p - '0');
+		else
+			exp++;
+	if (p < end && *p == '.')
+		for (p++; p < end && isdigit((unsigned char) *p); p++, digits++)
+			if (m < 100000000000000000LL) {
+				m = m * 10 + (*p - '0');
+				exp--;
+			}
+	if (digits && p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		if (p < end && (*p == '-' || *p == '+'))
+			eneg = *p++ == '-';
+		for (; p < end && isdigit((unsigned char) *p); p++)
+			if (e < 100)
+				e = e * 10 + (*p - '0');
+		exp += eneg ? -e : e;
+	}
+	*next = p;
+	if (p < end && !isspace((unsigned char) *p) && *p != ',')
+		return -1;
+	if (!digits)
+		return neg ? 0 : -1;
+	for (; exp > 0 && m < 1000000000000LL; exp--)
+		m *= 10;
+	for (; exp < 0; exp++)
+		m = (m + (exp == -1 ? 5 : 0)) / 10;		// round on the last digit dropped
+	if (exp > 0 || m > INT32_MAX)
+		m = INT32_MAX;
+	*uv = neg ? -m : m;
+	return 1;
+}
+
+// a data row starts with a number or a "-" placeholder; anything else is header
+// or comment
+
+static int isDataLine(const char *p, const char *end) {
+	int32_t v;
+
+	return parseValue(p, end, &v, &p) >= 0;
+}
+
+static void *countRows(void *arg) {
+	struct importChunk *c = arg;
+	const char *p;
+
+	c->rows = 0;
+	for (p = c->begin; p < c->end; p = nextLine(p, c->end))
+		c->rows += isDataLine(p, c->end);
+	return NULL;
+}
+
+static void *parseRows(void *arg) {
+	struct importChunk *c = arg;
+	const char *p, *q, *eol;
+	unsigned long row = c->first;
+	uint32_t a;
+	int32_t v;
+	int i, r;
+
+	for (i = 0; i < c->ncols; i++) {
+		c->gcd[i] = c->maxabs[i] = 0;
+		c->last[i] = -1;
+	}
+	for (p = c->begin; p < c->end; p = eol) {
+		eol = nextLine(p, c->end);
+		if (!isDataLine(p, eol))
+			continue;
+		q = p;
+		if (c->index)
+			parseValue(q, eol, &v, &q);
+		for (i = 0; i < c->ncols; i++) {
+			r = parseValue(q, eol, &v, &q);
+			while (q < eol && *q == ',')
+				q++;
+			if (r <= 0) {
+				c->cols[i][row] = IMPORT_MISSING;
+				continue;
+			}
+			c->cols[i][row] = v;
+			a = v < 0 ? -(uint32_t) v : (uint32_t) v;
+			c->gcd[i] = gcd(c->gcd[i], a);
+			if (a > c->maxabs[i])
+				c->maxabs[i] = a;
+			c->last[i] = row;
+		}
+		row++;
+	}
+	return NULL;
+}
+
+// a thread per chunk, or the chunk done right here if no thread can be had
+
+static void runChunk(struct importChunk *c, void *(*work)(void *)) {
+	c->threaded = pthread_create(&c->thread, NULL, work, c) == 0;
+	if (!c->threaded)
+		work(c);
+}
+
+// "<key>" followed by a time with its unit, e.g. "Timebase: 500 us" or
+// "Timebase: (0.5ms)"; returns 1 with the time in us
+
+static int headerTime(const char *line, const char *key, double *us) {
+	const char *p = strstr(line, key);
+	char *q;
+	double t;
+
+	if (!p)
+		return 0;
+	for (p += strlen(key); *p == ':' || *p == ' ' || *p == '(' || *p == '\t'; p++)
+		;
+	t = strtod(p, &q);
+	if (q == p)
+		return 0;
+	while (*q == ' ')
+		q++;
+	if (!strncmp(q, "ns", 2))
+		t /= 1000;
+	else if (!strncmp(q, "ms", 2))
+		t *= 1000;
+	else if (*q == 's')
+		t *= 1000000;
+	*us = t;
+	return 1;
+}
+
+// a comment line holding nothing but short names is the column header
+// ("# CH1	CH2	" or "#		  CH1		  CH2")
+
+static int headerNames(const char *line, char names[][4]) {
+	char buf[256], *tok, *save;
+	int n = 0;
+
+	snprintf(buf, sizeof(buf), "%s", line + 1);
+	for (tok = strtok_r(buf, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+		if (strlen(tok) > VECTORGRAM_BLOCK_HEADER_CHNAMELEN || !isalpha((unsigned char) *tok) || n == MAX_FRAME_CHANNELS)
+			return 0;
+		strcpy(names[n++], tok);
+	}
+	return n;
+}
+
+// the finest sensitivity (code, probe) that still gets the largest value of the
+// column onto the scope's screen, so the samples come out in the same range as
+// a real capture's. The x1 probe unless even 5V/div can't reach; among those
+// that fit, one whose 1/25 division steps every value is a whole multiple of.
+// Returns 0 if the values had to be rounded.
+
+static int chooseSensitivity(uint32_t g, uint32_t maxabs, struct channelHeader *h) {
+	uint64_t step;
+	unsigned code, probe = 0, finest = 10, exact = 0;
+
+	h->vertsenscode = 8;				// 1V/div if the channel is all zero
+	h->probexcode = 0;
+	if (!g)
+		return 1;
+	while (probe < 3 && (uint64_t) owonVertSensitivity(10, probe) * 1000 / SAMPLE_COUNTS_PER_DIV * SAMPLE_FULL_SCALE < maxabs)
+		probe++;
+	for (code = 10; code >= 1; code--) {	// coarse to fine, so the last match is the finest
+		step = (uint64_t) owonVertSensitivity(code, probe) * 1000 / SAMPLE_COUNTS_PER_DIV;	// uV
+		if (code < 10 && step * SAMPLE_FULL_SCALE < maxabs)
+			break;
+		finest = code;
+		if (g % step == 0)
+			exact = code;
+	}
+	h->vertsenscode = exact ? exact : finest;
+	h->probexcode = probe;
+	return exact != 0;
+}
+
+static unsigned timebaseCode(double us) {
+	unsigned code, best = 0x0f;
+	double err, bestErr = 1e9;
+
+	for (code = 0; code <= 0x1f; code++) {
+		err = fabs(log(owonTimebaseSeconds(code) * 1e6 / us));
+		if (err < bestErr) {
+			bestErr = err;
+			best = code;
+		}
+	}
+	return best;
+}
+
+static int writeDump(const struct owonFrame *frame, const char *name) {
+	unsigned size = owonFrameEncode(frame, NULL, 0);
+	unsigned char *buf = malloc(size);
+	FILE *fp;
+
+	if (!buf) {
+		printf("..Failed to malloc(%08xh)!\n", size);
+		return -1;
+	}
+	owonFrameEncode(frame, buf, size);
+	if ((fp = fopen(name, "w")) == NULL) {
+		printf("..Failed to open file \'%s\'!\n", name);
+		free(buf);
+		return -1;
+	}
+	if (fwrite(buf, 1, size, fp) != size)
+		printf("..Failed to write \'%s\'!\n", name);
+	free(buf);
+	return fclose(fp);
+}
+
+// x.txt becomes x.spb - never x.bin, which is likely to be the original dump
+
+static int importFile(const char *name, int threads, unsigned long *bytes) {
+	struct importChunk chunk[threads];
+	struct owonFrame frame;
+	char names[MAX_FRAME_CHANNELS][4], line[256], outname[strlen(name) + 5];
+	const char *text, *end, *data, *p, *q;
+	double timebase = 0, t_sample = 0, scale;
+	unsigned long rows = 0;
+	int32_t *cols[MAX_FRAME_CHANNELS], v;
+	int fd, i, k, n, nnames = 0, ncols = 0, index = -1, exact, status = -1;
+	struct stat sb;
+
+	if ((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+		printf("..Couldn\'t open %s\n", name);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if (!sb.st_size) {
+		printf("..%s is empty\n", name);
+		close(fd);
+		return -1;
+	}
+	text = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (text == MAP_FAILED) {
+		printf("..Failed to mmap %s\n", name);
+		return -1;
+	}
+	madvise((void *) text, sb.st_size, MADV_SEQUENTIAL);
+	end = text + sb.st_size;
+	*bytes += sb.st_size;
+
+// the header: everything before the first row of numbers
+
+	for (data = text; data < end && !isDataLine(data, end); data = nextLine(data, end)) {
+		n = nextLine(data, end) - data;
+		snprintf(line, sizeof(line), "%.*s", n < (int) sizeof(line) ? n : (int) sizeof(line) - 1, data);
+		headerTime(line, "Timebase", &timebase);
+		headerTime(line, "t_sample", &t_sample);
+		if (strstr(line, "Units:(mV)"))
+			index = 1;					// owonfileread numbers its rows
+		if (line[0] == '#' && (k = headerNames(line, names)) > 0)
+			nnames = k;
+	}
+	if (data == end) {
+		printf("..No trace data in %s\n", name);
+		goto bail;
+	}
+	for (q = data, p = nextLine(data, end); parseValue(q, p, &v, &q) >= 0; ncols++)
+		while (q < p && *q == ',')
+			q++;
+	if (index < 0) {
+		if (nnames)
+			index = ncols == nnames + 1;
+		else {							// a first column counting 1, 2, ... is a row index
+			int32_t second = 0;
+			q = nextLine(data, end);
+			index = ncols > 1 && parseValue(data, end, &v, &p) > 0 && v == 1000 &&
+				parseValue(q, end, &second, &p) > 0 && second == 2000;
+		}
+	}
+	ncols -= index;
+	if (ncols > MAX_FRAME_CHANNELS)
+		ncols = MAX_FRAME_CHANNELS;
+	if (ncols < 1) {
+		printf("..No trace data in %s\n", name);
+		goto bail;
+	}
+
+// split the data at line boundaries, count the rows of each piece, then parse
+
+	n = (end - data) / IMPORT_MIN_CHUNK + 1;
+	if (n > threads)
+		n = threads;
+	for (i = 0; i < n; i++) {
+		chunk[i].begin = i ? chunk[i-1].end : data;
+		chunk[i].end = i == n - 1 ? end : data + (end - data) / n * (i + 1);
+		if (chunk[i].end < chunk[i].begin)
+			chunk[i].end = chunk[i].begin;
+		if (chunk[i].end > data && chunk[i].end < end && chunk[i].end[-1] != '\n')
+			chunk[i].end = nextLine(chunk[i].end, end);
+		chunk[i].ncols = ncols;
+		chunk[i].index = index;
+		chunk[i].cols = cols;
+		runChunk(&chunk[i], countRows);
+	}
+	for (i = 0; i < n; i++) {
+		if (chunk[i].threaded)
+			pthread_join(chunk[i].thread, NULL);
+		chunk[i].first = rows;
+		rows += chunk[i].rows;
+	}
+	for (i = 0; i < ncols; i++)
+		cols[i] = NULL;
+	for (i = 0; i < ncols; i++)
+		if ((cols[i] = malloc(rows * sizeof(int32_t))) == NULL) {
+			printf("..Failed to malloc(%08lxh)!\n", rows * sizeof(int32_t));
+			goto freecols;
+		}
+	for (i = 0; i < n; i++)
+		runChunk(&chunk[i], parseRows);
+	for (i = 0; i < n; i++)
+		if (chunk[i].threaded)
+			pthread_join(chunk[i].thread, NULL);
+	for (i = 1; i < n; i++)
+		for (k = 0; k < ncols; k++) {
+			chunk[0].gcd[k] = gcd(chunk[0].gcd[k], chunk[i].gcd[k]);
+			if (chunk[i].maxabs[k] > chunk[0].maxabs[k])
+				chunk[0].maxabs[k] = chunk[i].maxabs[k];
+			if (chunk[i].last[k] > chunk[0].last[k])
+				chunk[0].last[k] = chunk[i].last[k];
+		}
+
+// and back into scope samples
+
+	if (t_sample <= 0 && timebase > 0)
+		t_sample = timebase * SCHED_SCREEN_DIVISIONS / rows;
+	if (timebase <= 0 && t_sample > 0)
+		timebase = t_sample * rows / SCHED_SCREEN_DIVISIONS;
+	if (timebase <= 0)
+		printf("..%s: no timebase in the header, written as 0\n", name);
+
+	memset(&frame, 0, sizeof(frame));
+	frame.model = model;
+	for (i = 0; i < ncols; i++) {
+		struct channelHeader *h = &frame.headers[i];
+		unsigned j, count = chunk[0].last[i] + 1;
+
+		memset(h, 0, sizeof(*h));
+		if (i < nnames && nnames == ncols)
+			strcpy(h->channelname, names[i]);
+		else
+			sprintf(h->channelname, "CH%d", (i + 1) % 10);
+		exact = chooseSensitivity(chunk[0].gcd[i], chunk[0].maxabs[i], h);
+		h->vertSensitivity = owonVertSensitivity(h->vertsenscode, h->probexcode);
+		h->samplecount1 = h->samplecount2 = count;
+		h->timebasecode = timebase > 0 ? timebaseCode(timebase) : 0;
+		h->t_sample = t_sample;
+		scale = h->vertSensitivity * 1000.0 / SAMPLE_COUNTS_PER_DIV;		// uV per count
+		if (!exact)
+			printf("..%s %s: values aren\'t on the scope\'s steps, rounded to %g mV\n", name, h->channelname, scale / 1000);
+		if (owonFrameReserve(&frame, i, count) < 0)
+			goto freeframe;
+		for (j = 0; j < count; j++)
+			frame.samples[i][j] = cols[i][j] == IMPORT_MISSING ? 0 : lround(cols[i][j] / scale);
+		frame.channelcount++;
+	}
+
+	strcpy(outname, name);
+	if (strlen(outname) > 4 && !strcmp(outname + strlen(outname) - 4, ".txt"))
+		outname[strlen(outname) - 4] = '\0';
+	strcat(outname, ".spb");
+	if (!writeDump(&frame, outname)) {
+		printf("..Imported %s: %lu rows of %d channels (", name, rows, frame.channelcount);
+		for (i = 0; i < frame.channelcount; i++)
+			printf("%s%s %dmV/div", i ? ", " : "", frame.headers[i].channelname, frame.headers[i].vertSensitivity);
+		printf(") into \'%s\'\n", outname);
+		status = 0;
+	}
+
+freeframe:
+	owonFrameFree(&frame);
+freecols:
+	for (i = 0; i < ncols; i++)
+		free(cols[i]);
+bail:
+	munmap((void *) text, sb.st_size);
+	return status;
+}
+
+void usage(void) {
+	printf("..Usage: owontxtimport [-j threads] [-M model] textfile(s)\n");
+	printf("        -j n   threads to parse each file with (default: one per CPU)\n");
+	printf("        -M c   model letter for the dump header: V (PDS5022S), W (PDS6060S), X (PDS7102T)\n");
+	printf("        each x.txt is written as x.spb, in the scope\'s own binary format\n");
+}
+
+int main(int argc, char *argv[]) {
+  int opt, i, threads = sysconf(_SC_NPROCESSORS_ONLN), failed = 0;
+  unsigned long bytes = 0;
+  double started;
+
+  while ((opt = getopt(argc, argv, "j:M:h")) != -1) {
+	  switch (opt) {
+		case 'j' : threads = atoi(optarg);
+				   break;
+		case 'M' : model = optarg[0];
+				   break;
+		default  : usage();
+				   return 0;
+	  }
+  }
+  if (optind >= argc) {
+	  usage();
+	  return 0;
+  }
+  if (threads < 1)
+	  threads = 1;
+
+  started = owonNow();
+  for (i = optind; i < argc; i++)
+	  failed += importFile(argv[i], threads, &bytes) < 0;
+  printf("..Imported %d of %d files, %.1f MB of text in %.2f s\n", argc - optind - failed, argc - optind,
+	  bytes / 1e6, owonNow() - started);
+  return 0;
+}
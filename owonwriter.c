@@ -0,0 +1,288 @@
+/*
+ * owonwriter.c
+ *				Takes the file writing out of the capture loop. owondump formats each output
+ *				file into memory and queues it; a writer thread empties the queue with one
+ *				large write per file, so a slow disk or an NFS stall only ever holds up the
+ *				writer thread, never the USB reads. The queue is a fixed ring of slots with
+ *				one producer and one consumer, handed over with atomic head and tail indices.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "owonwriter.h"
+
+static int writeAll(int fd, const char *p, size_t size) {
+	ssize_t n;
+
+	while (size) {
+		if ((n = write(fd, p, size)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+// fsync the directory the file was renamed in, so the new name is durable too
+
+static void syncDirectory(const char *name, char *lastdir, size_t len) {
+	const char *slash = strrchr(name, '/');
+	char dir[len];
+	int fd;
+
+	if (slash)
+		snprintf(dir, len, "%.*s", (int) (slash - name + 1), name);
+	else
+		strcpy(dir, ".");
+	if (!strcmp(dir, lastdir))
+		return;
+	strcpy(lastdir, dir);
+	if ((fd = open(dir, O_RDONLY)) >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+}
+
+// the complete file under its real name; a failure counts like a failed write
+
+static int renameInto(struct owonWriter *w, const char *tmpname, const char *name) {
+	if (rename(tmpname, name) == 0)
+		return 0;
+	printf("..Failed to write \'%s\': %s\n", name, strerror(errno));
+	unlink(tmpname);
+	atomic_fetch_add(&w->failed, 1);
+	return -1;
+}
+
+static void flushGroup(struct owonWriter *w) {
+	struct owonWriterPending *p;
+	char lastdir[PATH_MAX + 1] = "";
+	unsigned i;
+	int ret;
+
+	for (i = 0; i < w->pending; i++) {
+		p = &w->group[i];
+		ret = fsync(p->fd);
+		if (close(p->fd) < 0 || ret < 0) {
+			printf("..Failed to write \'%s\': %s\n", p->name, strerror(errno));
+			unlink(p->tmpname);
+			free(p->tmpname);
+			p->tmpname = NULL;
+			atomic_fetch_add(&w->failed, 1);
+		}
+	}
+	for (i = 0; i < w->pending; i++) {
+		p = &w->group[i];
+		if (p->tmpname && renameInto(w, p->tmpname, p->name) == 0) {
+			syncDirectory(p->name, lastdir, sizeof(lastdir));
+			atomic_fetch_add(&w->written, 1);
+		}
+		free(p->tmpname);
+		free(p->name);
+	}
+	if (w->pending)
+		atomic_fetch_add(&w->syncs, 1);
+	w->pending = 0;
+}
+
+static void stampFile(int fd, double mtime) {
+	struct timespec ts[2];
+
+	ts[0].tv_sec = (time_t) mtime;
+	ts[0].tv_nsec = (long) ((mtime - ts[0].tv_sec) * 1e9);
+	ts[1] = ts[0];
+	futimens(fd, ts);
+}
+
+// a piece of a growing file, straight into place
+
+static void appendJob(struct owonWriter *w, struct owonWriteJob *job) {
+	int fd = open(job->name, O_WRONLY | O_CREAT | (job->mode == WRITER_APPEND ? O_APPEND : O_TRUNC), 0644);
+
+	if (fd < 0 || writeAll(fd, job->data, job->size) < 0 || close(fd) < 0) {
+		printf("..Failed to write '%s': %s\n", job->name, strerror(errno));
+		atomic_fetch_add(&w->failed, 1);
+	}
+	else if (job->mode == WRITER_CREATE)
+		atomic_fetch_add(&w->written, 1);
+	atomic_fetch_add(&w->bytes, job->size);
+	free(job->name);
+	free(job->data);
+}
+
+static void writeJob(struct owonWriter *w, struct owonWriteJob *job) {
+	char *tmpname;
+	int fd = -1, ok = 0;
+
+	if (job->mode != WRITER_REPLACE) {
+		appendJob(w, job);
+		return;
+	}
+	tmpname = malloc(strlen(job->name) + 5);
+
+	if (tmpname) {
+		sprintf(tmpname, "%s.tmp", job->name);
+		fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (fd >= 0 && writeAll(fd, job->data, job->size) == 0) {
+		if (job->mtime > 0)
+			stampFile(fd, job->mtime);
+		ok = w->groupSize || close(fd) == 0;
+	}
+	else if (fd >= 0)
+		close(fd);
+
+	if (!ok) {
+		printf("..Failed to write \'%s\': %s\n", job->name, strerror(errno));
+		if (fd >= 0)
+			unlink(tmpname);
+		atomic_fetch_add(&w->failed, 1);
+		free(tmpname);
+		free(job->name);
+	}
+	else if (!w->groupSize) {
+		if (renameInto(w, tmpname, job->name) == 0)
+			atomic_fetch_add(&w->written, 1);
+		free(tmpname);
+		free(job->name);
+	}
+	else {
+		w->group[w->pending].fd = fd;
+		w->group[w->pending].tmpname = tmpname;
+		w->group[w->pending].name = job->name;
+		if (++w->pending == w->groupSize)
+			flushGroup(w);
+	}
+	atomic_fetch_add(&w->bytes, job->size);
+	free(job->data);
+}
+
+static void *writerThread(void *arg) {
+	struct owonWriter *w = arg;
+	struct owonWriteJob job;
+	struct timespec ts;
+	unsigned head, tail;
+	int ret;
+
+	for (;;) {
+		if (w->pending) {			// don't leave a part group unsynced for long
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += (time_t) WRITER_GROUP_DELAY;
+			ts.tv_nsec += (long) ((WRITER_GROUP_DELAY - (time_t) WRITER_GROUP_DELAY) * 1e9);
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			ret = sem_timedwait(&w->ready, &ts);
+		}
+		else
+			ret = sem_wait(&w->ready);
+		if (ret < 0 && errno == ETIMEDOUT)
+			flushGroup(w);
+		if (ret < 0)
+			continue;
+
+		tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+		head = atomic_load_explicit(&w->head, memory_order_acquire);
+		if (tail != head) {
+			job = w->slots[tail % WRITER_QUEUE_SLOTS];
+			atomic_store_explicit(&w->tail, tail + 1, memory_order_release);
+			writeJob(w, &job);
+		}
+		else if (atomic_load(&w->stopping))
+			break;					// the queue is empty and nothing more is coming
+	}
+	flushGroup(w);
+	return NULL;
+}
+
+int owonWriterStart(struct owonWriter *w, unsigned groupSize) {
+	memset(w, 0, sizeof(*w));
+	w->groupSize = groupSize > WRITER_MAX_GROUP ? WRITER_MAX_GROUP : groupSize;
+	if (sem_init(&w->ready, 0, 0) < 0 || pthread_create(&w->thread, NULL, writerThread, w)) {
+		printf("..Failed to start the writer thread\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int queueJob(struct owonWriter *w, const char *name, char *data, size_t size, double mtime,
+		enum owonWriteMode mode) {
+	unsigned head = atomic_load_explicit(&w->head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&w->tail, memory_order_acquire);
+	struct owonWriteJob *job = &w->slots[head % WRITER_QUEUE_SLOTS];
+
+	if (head - tail == WRITER_QUEUE_SLOTS || (job->name = strdup(name)) == NULL) {
+		atomic_fetch_add(&w->dropped, 1);
+		free(data);
+		return -1;
+	}
+	job->data = data;
+	job->size = size;
+	job->mtime = mtime;
+	job->mode = mode;
+	atomic_store_explicit(&w->head, head + 1, memory_order_release);
+	sem_post(&w->ready);
+	return 0;
+}
+
+// hand over a complete file image (data must come from malloc). Never blocks:
+// returns -1, and counts the file as dropped, if the queue is full.
+
+int owonWriterQueue(struct owonWriter *w, const char *name, char *data, size_t size, double mtime) {
+	return queueJob(w, name, data, size, mtime, WRITER_REPLACE);
+}
+
+// the next piece of a file that grows capture by capture: append 0 starts it
+// afresh. The same rules as owonWriterQueue() - a piece can be dropped.
+
+int owonWriterAppend(struct owonWriter *w, const char *name, char *data, size_t size, int append) {
+	return queueJob(w, name, data, size, 0, append ? WRITER_APPEND : WRITER_CREATE);
+}
+
+// wait for the queue to empty, for the files that are only written once the
+// captures are over and mustn't be dropped
+
+void owonWriterDrain(struct owonWriter *w) {
+	while (atomic_load(&w->tail) != atomic_load(&w->head))
+		usleep(1000);
+}
+
+// a FILE that writes into memory, for formatting a file to be queued
+
+FILE *owonWriterOpen(char **data, size_t *size) {
+	FILE *fp = open_memstream(data, size);
+
+	if (!fp)
+		printf("..Failed to open a memory stream\n");
+	return fp;
+}
+
+int owonWriterQueueStream(struct owonWriter *w, const char *name, FILE *fp, char **data, size_t *size,
+		double mtime) {
+	if (fclose(fp)) {
+		free(*data);
+		atomic_fetch_add(&w->failed, 1);
+		return -1;
+	}
+	return owonWriterQueue(w, name, *data, *size, mtime);
+}
+
+// write out whatever is still queued and stop the thread
+
+void owonWriterStop(struct owonWriter *w) {
+	atomic_store(&w->stopping, 1);
+	sem_post(&w->ready);
+	pthread_join(w->thread, NULL);
+	sem_destroy(&w->ready);
+}
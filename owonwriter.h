@@ -0,0 +1,67 @@
+// owonwriter.h - asynchronous output files, written by a thread of their own
+
+#ifndef OWONWRITER_H
+#define OWONWRITER_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#define WRITER_QUEUE_SLOTS 256			  // files waiting to be written (power of two)
+#define WRITER_MAX_GROUP 64				  // files per fsync group
+#define WRITER_GROUP_DELAY 1.0			  // seconds an unsynced group may wait for more files
+
+// The capture loop hands over complete file images and carries on; it never
+// waits for the disk. A full queue drops the file and counts it instead. Each
+// file is written to <name>.tmp in one go and renamed over <name> once it is
+// complete, so a reader never sees half a file. With group fsync on, every
+// groupSize files are fsync'ed together (or after WRITER_GROUP_DELAY without
+// new files) before they are renamed into place, and their directory after.
+// Files can carry the time of their capture as their modification time, which
+// is what owonfileread -s and owonmerge go by. Files that grow capture by
+// capture (the stitched .roll records) are queued a piece at a time instead and
+// written in place, in queue order; they are not part of the fsync groups.
+
+enum owonWriteMode {
+	WRITER_REPLACE,					// a whole file, through <name>.tmp and a rename
+	WRITER_CREATE,					// the start of a growing file, written in place
+	WRITER_APPEND					// ..and the rest of it
+};
+
+struct owonWriteJob {
+	char *name;
+	char *data;						// malloc'ed, freed by the writer
+	size_t size;
+	double mtime;					// capture time to stamp the file with, 0 for now
+	enum owonWriteMode mode;
+};
+
+struct owonWriterPending {
+	int fd;
+	char *tmpname, *name;
+};
+
+struct owonWriter {
+	pthread_t thread;
+	sem_t ready;						// one post per queued job, and one to stop
+	struct owonWriteJob slots[WRITER_QUEUE_SLOTS];
+	atomic_uint head, tail;				// single producer, single consumer
+	atomic_int stopping;
+	unsigned groupSize;					// 0: no fsync at all
+	struct owonWriterPending group[WRITER_MAX_GROUP];	// written, waiting for the group fsync
+	unsigned pending;
+	atomic_ulong written, dropped, failed, syncs;
+	atomic_ullong bytes;
+};
+
+int owonWriterStart(struct owonWriter *w, unsigned groupSize);
+int owonWriterQueue(struct owonWriter *w, const char *name, char *data, size_t size, double mtime);
+int owonWriterAppend(struct owonWriter *w, const char *name, char *data, size_t size, int append);
+void owonWriterDrain(struct owonWriter *w);
+FILE *owonWriterOpen(char **data, size_t *size);
+int owonWriterQueueStream(struct owonWriter *w, const char *name, FILE *fp, char **data, size_t *size,
+		double mtime);
+void owonWriterStop(struct owonWriter *w);
+
+#endif // OWONWRITER_H